@@ -0,0 +1,173 @@
+#include "devices/lapic.h"
+#include <debug.h>
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/mmu.h"
+#include "threads/pte.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+/* The local APIC, used here only for its timer.
+
+   The 8259 PICs keep delivering every other interrupt through
+   the local APIC's LINT0 pin ("virtual wire" mode), so enabling
+   the local APIC changes nothing else.  The timer is run one shot
+   at a time: in TSC-deadline mode if the CPU has it, so that it
+   fires when the TSC reaches a given value, and otherwise in
+   one-shot mode, counting down a bus clock measured against the
+   TSC.  See [IA32-v3a] chapter 10 "Advanced Programmable
+   Interrupt Controller (APIC)". */
+
+/* MSRs. */
+#define MSR_APIC_BASE 0x1b          /* Local APIC base address. */
+#define MSR_TSC_DEADLINE 0x6e0      /* TSC-deadline timer target. */
+
+/* CPUID.1 bits. */
+#define CPUID_EDX_APIC (1 << 9)     /* Local APIC present. */
+#define CPUID_ECX_TSC_DEADLINE (1 << 24) /* TSC-deadline timer. */
+
+/* Register offsets. */
+#define LAPIC_TPR 0x080             /* Task priority. */
+#define LAPIC_EOI 0x0b0             /* End of interrupt. */
+#define LAPIC_SVR 0x0f0             /* Spurious interrupt vector. */
+#define LAPIC_LVT_TIMER 0x320       /* Timer local vector. */
+#define LAPIC_LVT_LINT0 0x350       /* LINT0 local vector. */
+#define LAPIC_LVT_LINT1 0x360       /* LINT1 local vector. */
+#define LAPIC_TIMER_INIT 0x380      /* Timer initial count. */
+#define LAPIC_TIMER_CUR 0x390       /* Timer current count. */
+#define LAPIC_TIMER_DIV 0x3e0       /* Timer divide configuration. */
+
+/* Register bits. */
+#define SVR_ENABLE 0x100            /* Software enable. */
+#define LVT_MASKED 0x10000          /* Interrupt masked. */
+#define LVT_EXTINT 0x700            /* Deliver as from the 8259. */
+#define LVT_NMI 0x400               /* Deliver as an NMI. */
+#define LVT_TSC_DEADLINE 0x40000    /* Timer in TSC-deadline mode. */
+#define TIMER_DIV_16 0x3            /* Count every 16 bus clocks. */
+
+#define SPURIOUS_VEC 0xff
+
+/* Number of microseconds lapic_init() measures the timer over. */
+#define CALIBRATE_US 10000
+
+static volatile uint32_t *lapic;    /* Mapped registers, or NULL. */
+static bool use_tsc_deadline;       /* TSC-deadline mode? */
+static uint64_t tsc_per_us;         /* TSC rate. */
+static uint64_t count_per_ms;       /* One-shot mode count rate. */
+
+static void spurious_interrupt (struct intr_frame *);
+
+static uint32_t
+lapic_read (int reg) {
+	return lapic[reg / sizeof *lapic];
+}
+
+static void
+lapic_write (int reg, uint32_t value) {
+	lapic[reg / sizeof *lapic] = value;
+}
+
+/* Maps and enables the local APIC and calibrates its timer, given
+   the TSC's rate.  Returns false, leaving the local APIC alone, if
+   the CPU has none. */
+bool
+lapic_init (uint64_t tsc_per_us_) {
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t base;
+	uint64_t *pte;
+
+	cpuid (1, 0, &eax, &ebx, &ecx, &edx);
+	if (!(edx & CPUID_EDX_APIC) || tsc_per_us_ == 0)
+		return false;
+	use_tsc_deadline = (ecx & CPUID_ECX_TSC_DEADLINE) != 0;
+	tsc_per_us = tsc_per_us_;
+
+	/* The registers lie above the RAM paging_init() maps.  The
+	   mapping goes into the kernel half of base_pml4, which every
+	   page table shares. */
+	base = read_msr (MSR_APIC_BASE) & ~(uint64_t) PGMASK;
+	pte = pml4e_walk (base_pml4, (uint64_t) ptov (base), 1);
+	if (pte == NULL)
+		return false;
+	*pte = base | PTE_P | PTE_W | PTE_PCD | PTE_PWT;
+	pml4_activate (NULL);
+	lapic = ptov (base);
+
+	intr_register_int (SPURIOUS_VEC, 0, INTR_OFF, spurious_interrupt,
+			"LAPIC spurious");
+	lapic_write (LAPIC_LVT_LINT0, LVT_EXTINT);
+	lapic_write (LAPIC_LVT_LINT1, LVT_NMI);
+	lapic_write (LAPIC_TPR, 0);
+	lapic_write (LAPIC_SVR, SVR_ENABLE | SPURIOUS_VEC);
+
+	if (use_tsc_deadline) {
+		lapic_write (LAPIC_LVT_TIMER, LVT_TSC_DEADLINE | LAPIC_TIMER_VEC);
+	} else {
+		/* Count down from the top for CALIBRATE_US by the TSC. */
+		uint64_t start;
+
+		lapic_write (LAPIC_TIMER_DIV, TIMER_DIV_16);
+		lapic_write (LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_TIMER_VEC);
+		start = rdtsc ();
+		lapic_write (LAPIC_TIMER_INIT, UINT32_MAX);
+		while (rdtsc () - start < CALIBRATE_US * tsc_per_us)
+			barrier ();
+		count_per_ms = (UINT32_MAX - lapic_read (LAPIC_TIMER_CUR))
+			/ (CALIBRATE_US / 1000);
+		lapic_write (LAPIC_TIMER_INIT, 0);
+		if (count_per_ms == 0)
+			return false;
+		lapic_write (LAPIC_LVT_TIMER, LAPIC_TIMER_VEC);
+	}
+	return true;
+}
+
+/* Returns true if the timer runs in TSC-deadline mode. */
+bool
+lapic_tsc_deadline (void) {
+	return use_tsc_deadline;
+}
+
+/* Acknowledges the interrupt being handled. */
+void
+lapic_eoi (void) {
+	lapic_write (LAPIC_EOI, 0);
+}
+
+/* Makes the timer interrupt once the TSC reaches DEADLINE, or at
+   once if it already has, replacing any earlier setting. */
+void
+lapic_timer_arm (uint64_t deadline) {
+	uint64_t now, count;
+
+	if (use_tsc_deadline) {
+		write_msr (MSR_TSC_DEADLINE, deadline);
+		return;
+	}
+
+	now = rdtsc ();
+	count = 1;
+	if (deadline > now) {
+		count = (deadline - now) * count_per_ms / (tsc_per_us * 1000);
+		if (count == 0)
+			count = 1;
+		else if (count > UINT32_MAX)
+			count = UINT32_MAX;
+	}
+	lapic_write (LAPIC_TIMER_INIT, count);
+}
+
+/* Disarms the timer. */
+void
+lapic_timer_stop (void) {
+	if (use_tsc_deadline)
+		write_msr (MSR_TSC_DEADLINE, 0);
+	else
+		lapic_write (LAPIC_TIMER_INIT, 0);
+}
+
+/* Spurious interrupts need no acknowledgement. */
+static void
+spurious_interrupt (struct intr_frame *f UNUSED) {
+}
@@ -3,10 +3,12 @@
 #include <inttypes.h>
 #include <round.h>
 #include <stdio.h>
+#include "devices/lapic.h"
 #include "threads/interrupt.h"
 #include "threads/io.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
+#include "intrinsic.h"
 
 /* See [8254] for hardware details of the 8254 timer chip. */
 
@@ -24,10 +26,55 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Number of timer ticks timer_calibrate() measures the TSC over. */
+#define TSC_CALIBRATE_TICKS 4
+
+/* Number of TSC cycles per microsecond.
+   Initialized by timer_calibrate(). */
+static uint64_t tsc_per_us;
+
+/* Tickless mode.
+
+   With -tickless, once the TSC is calibrated the PIT is stopped
+   and the local APIC timer is armed one shot at a time, for the
+   next tick on which something is due: a parked thread's wake-up
+   or the end of the running thread's time slice.  The tick count
+   is then derived from the TSC: NEXT_TICK_TSC is the TSC value at
+   which tick number TICKS + 1 begins.  Threads in timer_msleep(),
+   timer_usleep() and timer_nsleep() instead wait on SLEEPERS for a
+   TSC deadline, which the timer is also armed for, so they block
+   for as long as asked rather than a whole number of ticks.  Ticks that pass with
+   nothing due are counted when the timer next fires, or at the
+   next context switch, by timer_sync().  An idle CPU with no
+   sleepers is not interrupted at all. */
+bool timer_tickless;            /* -tickless given? */
+static bool tickless;           /* Running tickless? */
+static uint64_t tsc_per_tick;   /* TSC cycles per tick. */
+static uint64_t next_tick_tsc;  /* TSC at which tick TICKS + 1 begins. */
+static long long lapic_intr_cnt; /* # of local APIC timer interrupts. */
+
+/* A thread sleeping until a TSC deadline, in tickless mode. */
+struct sleeper {
+	uint64_t deadline;          /* TSC value to wake up at. */
+	struct thread *thread;      /* The sleeping thread. */
+	struct semaphore sema;      /* Upped at DEADLINE. */
+	struct list_elem elem;      /* Element in sleepers. */
+};
+
+/* Sleeping threads, soonest deadline first. */
+static struct list sleepers;
+
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
+static void tick (void);
+static int64_t ticks_due (uint64_t tsc);
+static uint64_t real_time_cycles (int64_t num, int32_t denom);
+static void sleep_until (uint64_t deadline);
+static void wake_sleepers (uint64_t tsc);
+static bool sleeper_less (const struct list_elem *,
+		const struct list_elem *, void *aux);
 
 /* Sets up the 8254 Programmable Interval Timer (PIT) to
    interrupt PIT_FREQ times per second, and registers the
@@ -43,9 +90,11 @@ timer_init (void) {
 	outb (0x40, count >> 8);
 
 	intr_register_ext (0x20, timer_interrupt, "8254 Timer");
+	list_init (&sleepers);
 }
 
-/* Calibrates loops_per_tick, used to implement brief delays. */
+/* Calibrates loops_per_tick, used to implement brief delays, and
+   the rate of the TSC. */
 void
 timer_calibrate (void) {
 	unsigned high_bit, test_bit;
@@ -68,6 +117,50 @@ timer_calibrate (void) {
 			loops_per_tick |= test_bit;
 
 	printf ("%'"PRIu64" loops/s.\n", (uint64_t) loops_per_tick * TIMER_FREQ);
+
+	/* Measure the TSC rate over a few whole timer ticks. */
+	int64_t start = ticks;
+	while (ticks == start)
+		barrier ();
+	uint64_t tsc = rdtsc ();
+	start = ticks;
+	while (ticks - start < TSC_CALIBRATE_TICKS)
+		barrier ();
+	tsc = rdtsc () - tsc;
+	tsc_per_us = tsc / (TSC_CALIBRATE_TICKS * (1000 * 1000 / TIMER_FREQ));
+	if (tsc_per_us == 0)
+		tsc_per_us = 1;
+
+	/* MLFQS recomputes priorities on every tick, so it always
+	   runs with the periodic PIT. */
+	if (timer_tickless && !thread_mlfqs) {
+		if (lapic_init (tsc_per_us)) {
+			enum intr_level old_level = intr_disable ();
+
+			/* Leave the PIT in one-shot mode; should it fire once
+			   more, timer_interrupt() just catches up. */
+			outb (0x43, 0x30);  /* CW: counter 0, LSB then MSB, mode 0, binary. */
+			outb (0x40, 0xff);
+			outb (0x40, 0xff);
+
+			tsc_per_tick = tsc_per_us * (1000 * 1000 / TIMER_FREQ);
+			next_tick_tsc = rdtsc () + tsc_per_tick;
+			intr_register_ext (LAPIC_TIMER_VEC, timer_interrupt, "LAPIC Timer");
+			tickless = true;
+			timer_reprogram ();
+			intr_set_level (old_level);
+			printf ("Timer: tickless, local APIC in %s mode.\n",
+					lapic_tsc_deadline () ? "TSC-deadline" : "one-shot");
+		} else
+			printf ("Timer: no local APIC, staying periodic.\n");
+	}
+}
+
+/* Converts CYCLES of the TSC into microseconds.  Returns 0 before
+   timer_calibrate() has run. */
+uint64_t
+timer_tsc_to_us (uint64_t cycles) {
+	return tsc_per_us != 0 ? cycles / tsc_per_us : 0;
 }
 
 /* Returns the number of timer ticks since the OS booted. */
@@ -75,6 +168,8 @@ int64_t
 timer_ticks (void) {
 	enum intr_level old_level = intr_disable ();
 	int64_t t = ticks;
+	if (tickless)
+		t += ticks_due (rdtsc ());
 	intr_set_level (old_level);
 	barrier ();
 	return t;
@@ -114,15 +209,90 @@ timer_nsleep (int64_t ns) {
 	real_time_sleep (ns, 1000 * 1000 * 1000);
 }
 
+/* In tickless mode, counts the ticks that have passed since the
+   timer last fired and charges them to the running thread,
+   without preempting it or unparking anything.  Called by
+   schedule() before switching threads, so that the next thread
+   is not charged for its predecessor's time.  Threads due during
+   those ticks are unparked by the timer interrupt, which then is
+   already pending. */
+void
+timer_sync (void) {
+	int64_t n;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	if (!tickless)
+		return;
+
+	n = ticks_due (rdtsc ());
+	if (n > 0) {
+		ticks += n;
+		next_tick_tsc += n * tsc_per_tick;
+		thread_account_ticks (n);
+	}
+}
+
+/* In tickless mode, arms the local APIC timer for the next tick
+   on which something is due or the earliest sleeper's deadline,
+   whichever comes first, or stops it if nothing is due. */
+void
+timer_reprogram (void) {
+	int64_t now, next;
+	uint64_t deadline = UINT64_MAX;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	if (!tickless)
+		return;
+
+	now = ticks + ticks_due (rdtsc ());
+	next = thread_next_tick (now);
+	if (next != INT64_MAX) {
+		if (next <= ticks)
+			next = ticks + 1;
+		deadline = next_tick_tsc + (next - ticks - 1) * tsc_per_tick;
+	}
+	if (!list_empty (&sleepers)) {
+		struct sleeper *s = list_entry (list_front (&sleepers),
+				struct sleeper, elem);
+		if (s->deadline < deadline)
+			deadline = s->deadline;
+	}
+
+	if (deadline == UINT64_MAX)
+		lapic_timer_stop ();
+	else
+		lapic_timer_arm (deadline);
+}
+
 /* Prints timer statistics. */
 void
 timer_print_stats (void) {
 	printf ("Timer: %"PRId64" ticks\n", timer_ticks ());
+	if (tickless)
+		printf ("Timer: %lld local APIC interrupts\n", lapic_intr_cnt);
 }
 
 /* Timer interrupt handler. */
 static void
 timer_interrupt (struct intr_frame *args UNUSED) {
+	if (!tickless) {
+		tick ();
+		return;
+	}
+
+	/* Run every tick that has begun since the last one. */
+	lapic_intr_cnt++;
+	while (rdtsc () >= next_tick_tsc) {
+		next_tick_tsc += tsc_per_tick;
+		tick ();
+	}
+	wake_sleepers (rdtsc ());
+	timer_reprogram ();
+}
+
+/* Advances the tick count by one and does the per-tick work. */
+static void
+tick (void) {
 	ticks++;
 	thread_tick ();
 
@@ -131,20 +301,28 @@ timer_interrupt (struct intr_frame *args UNUSED) {
 		return;
 	}
 	
+	/* Between decays only the running thread's recent_cpu changes,
+	   so only its priority has to be recomputed every slice. */
 	thread_increase_recent_cpu (thread_current ());
 	if (ticks % TIMER_FREQ == 0) {
 		thread_update_load_avg ();
-		thread_update_recent_cpu_all ();
-		thread_update_priority_all ();
-	}
-
-	if (ticks % TIME_SLICE == 0 && ticks % TIMER_FREQ != 0) {
-		thread_update_priority_all ();
+		thread_decay_recent_cpu ();
+	} else if (ticks % TIME_SLICE == 0) {
+		thread_update_priority (thread_current ());
 	}
 
 	thread_try_unpark (ticks);
 }
 
+/* Returns the number of ticks that have begun at or after
+   NEXT_TICK_TSC by time TSC, that is, how far TICKS lags. */
+static int64_t
+ticks_due (uint64_t tsc) {
+	if (tsc < next_tick_tsc)
+		return 0;
+	return (tsc - next_tick_tsc) / tsc_per_tick + 1;
+}
+
 /* Returns true if LOOPS iterations waits for more than one timer
    tick, otherwise false. */
 static bool
@@ -188,16 +366,85 @@ real_time_sleep (int64_t num, int32_t denom) {
 	int64_t ticks = num * TIMER_FREQ / denom;
 
 	ASSERT (intr_get_level () == INTR_ON);
-	if (ticks > 0) {
+	if (tickless) {
+		/* The local APIC timer can be armed for any TSC value, so
+		   block until exactly then. */
+		if (num > 0)
+			sleep_until (rdtsc () + real_time_cycles (num, denom));
+	} else if (ticks > 0) {
 		/* We're waiting for at least one full timer tick.  Use
 		   timer_sleep() because it will yield the CPU to other
 		   processes. */
 		timer_sleep (ticks);
 	} else {
-		/* Otherwise, use a busy-wait loop for more accurate
-		   sub-tick timing.  We scale the numerator and denominator
-		   down by 1000 to avoid the possibility of overflow. */
-		ASSERT (denom % 1000 == 0);
-		busy_wait (loops_per_tick * num / 1000 * TIMER_FREQ / (denom / 1000));
+		/* Otherwise, spin on the TSC for more accurate sub-tick
+		   timing. */
+		uint64_t start = rdtsc ();
+		uint64_t cycles = real_time_cycles (num, denom);
+
+		while (rdtsc () - start < cycles)
+			barrier ();
+	}
+}
+
+/* Converts NUM/DENOM seconds, where DENOM is 1000, 1000000 or
+   1000000000, into TSC cycles. */
+static uint64_t
+real_time_cycles (int64_t num, int32_t denom) {
+	ASSERT (denom % 1000 == 0);
+
+	if (denom > 1000 * 1000)
+		return num * tsc_per_us / (denom / (1000 * 1000));
+	return num * ((1000 * 1000) / denom) * tsc_per_us;
+}
+
+/* Blocks the running thread until the TSC reaches DEADLINE.
+   Tickless mode only. */
+static void
+sleep_until (uint64_t deadline) {
+	struct sleeper s;
+	enum intr_level old_level;
+
+	ASSERT (tickless);
+
+	s.deadline = deadline;
+	s.thread = thread_current ();
+	sema_init (&s.sema, 0);
+	old_level = intr_disable ();
+	if (rdtsc () < deadline) {
+		list_insert_ordered (&sleepers, &s.elem, sleeper_less, NULL);
+		timer_reprogram ();
+		sema_down (&s.sema);
+	}
+	intr_set_level (old_level);
+}
+
+/* Wakes the sleepers whose deadlines are at or before TSC.  Run
+   by the timer interrupt, so a woken thread that outranks the
+   running one is switched to on return from it rather than at
+   the next tick. */
+static void
+wake_sleepers (uint64_t tsc) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	while (!list_empty (&sleepers)) {
+		struct sleeper *s = list_entry (list_front (&sleepers),
+				struct sleeper, elem);
+		if (s->deadline > tsc)
+			break;
+		list_pop_front (&sleepers);
+		if (s->thread->priority > thread_current ()->priority)
+			intr_yield_on_return ();
+		sema_up (&s->sema);
 	}
 }
+
+/* Returns true if sleeper A's deadline is before sleeper B's. */
+static bool
+sleeper_less (const struct list_elem *a_, const struct list_elem *b_,
+		void *aux UNUSED) {
+	const struct sleeper *a = list_entry (a_, struct sleeper, elem);
+	const struct sleeper *b = list_entry (b_, struct sleeper, elem);
+
+	return a->deadline < b->deadline;
+}
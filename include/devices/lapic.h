@@ -0,0 +1,17 @@
+#ifndef DEVICES_LAPIC_H
+#define DEVICES_LAPIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Interrupt vector of the local APIC timer.  It is handled as an
+   external interrupt, just past those of the PICs. */
+#define LAPIC_TIMER_VEC 0x30
+
+bool lapic_init (uint64_t tsc_per_us);
+void lapic_eoi (void);
+void lapic_timer_arm (uint64_t deadline);
+void lapic_timer_stop (void);
+bool lapic_tsc_deadline (void);
+
+#endif /* devices/lapic.h */
@@ -2,13 +2,19 @@
 #define DEVICES_TIMER_H
 
 #include <round.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Number of timer interrupts per second. */
 #define TIMER_FREQ 100
 
+/* Stop the periodic tick when possible.  Set by -tickless. */
+extern bool timer_tickless;
+
 void timer_init (void);
 void timer_calibrate (void);
+void timer_sync (void);
+void timer_reprogram (void);
 
 int64_t timer_ticks (void);
 int64_t timer_elapsed (int64_t);
@@ -18,6 +24,8 @@ void timer_msleep (int64_t milliseconds);
 void timer_usleep (int64_t microseconds);
 void timer_nsleep (int64_t nanoseconds);
 
+uint64_t timer_tsc_to_us (uint64_t cycles);
+
 void timer_print_stats (void);
 
 #endif /* devices/timer.h */
@@ -36,6 +36,15 @@ enum {
 
 	SYS_MOUNT,
 	SYS_UMOUNT,
+
+	/* User-level synchronization. */
+	SYS_FUTEX_WAIT,             /* Sleep if a user int has a value. */
+	SYS_FUTEX_WAKE,             /* Wake threads sleeping on a user int. */
+
+	/* User-level threads. */
+	SYS_THREAD_CREATE,          /* Start a thread in this process. */
+	SYS_THREAD_JOIN,            /* Wait for a thread to exit. */
+	SYS_THREAD_EXIT,            /* Exit the calling thread only. */
 };
 
 #endif /* lib/syscall-nr.h */
@@ -0,0 +1,27 @@
+#ifndef __LIB_USER_SYNCH_H
+#define __LIB_USER_SYNCH_H
+
+#include <stdbool.h>
+
+/* A mutex built on futex_wait() and futex_wake().  Locking and
+   unlocking an uncontended mutex make no system call. */
+struct mutex {
+	int state;                  /* 0: free, 1: held, 2: held with waiters. */
+};
+
+void mutex_init (struct mutex *);
+void mutex_lock (struct mutex *);
+bool mutex_trylock (struct mutex *);
+void mutex_unlock (struct mutex *);
+
+/* A condition variable used with a struct mutex. */
+struct condvar {
+	int seq;                    /* Bumped by every signal. */
+};
+
+void cond_init (struct condvar *);
+void cond_wait (struct condvar *, struct mutex *);
+void cond_signal (struct condvar *);
+void cond_broadcast (struct condvar *);
+
+#endif /* lib/user/synch.h */
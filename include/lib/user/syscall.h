@@ -9,6 +9,13 @@
 typedef int pid_t;
 #define PID_ERROR ((pid_t) -1)
 
+/* Thread identifier. */
+typedef int tid_t;
+#define TID_ERROR ((tid_t) -1)
+
+/* Function run by a thread made with thread_create(). */
+typedef void thread_func (void *aux);
+
 /* Map region identifier. */
 typedef int off_t;
 #define MAP_FAILED ((void *) NULL)
@@ -50,6 +57,15 @@ bool isdir (int fd);
 int inumber (int fd);
 int symlink (const char* target, const char* linkpath);
 
+/* User-level synchronization. */
+int futex_wait (const int *uaddr, int expected);
+int futex_wake (const int *uaddr, int cnt);
+
+/* User-level threads. */
+tid_t thread_create (thread_func *, void *aux);
+int thread_join (tid_t);
+void thread_exit (void) NO_RETURN;
+
 static inline void* get_phys_addr (void *user_addr) {
 	void* pa;
 	asm volatile ("movq %0, %%rax" ::"r"(user_addr));
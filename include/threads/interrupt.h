@@ -15,6 +15,12 @@ enum intr_level intr_set_level (enum intr_level);
 enum intr_level intr_enable (void);
 enum intr_level intr_disable (void);
 
+/* Interrupts-off window tracing. */
+extern bool intr_off_trace;
+void intr_off_reset (void);
+uint64_t intr_off_max (void **disabled_at, void **enabled_at);
+void intr_print_stats (void);
+
 /* Interrupt stack frame. */
 struct gp_registers {
 	uint64_t r15;
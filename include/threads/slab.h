@@ -0,0 +1,31 @@
+#ifndef THREADS_SLAB_H
+#define THREADS_SLAB_H
+
+#include <list.h>
+#include <stddef.h>
+#include "threads/synch.h"
+
+/* Cache of free objects in front of a slab cache's slabs. */
+#define SLAB_MAG_SIZE 16
+
+struct slab_magazine {
+	size_t cnt;                         /* Number of objects cached. */
+	void *objs[SLAB_MAG_SIZE];
+};
+
+/* A cache of objects of a single type.  See slab.c. */
+struct slab_cache {
+	const char *name;                   /* For debugging. */
+	size_t obj_size;                    /* Object size, rounded up. */
+	size_t objs_per_slab;               /* Objects in each slab page. */
+	struct mutex lock;                  /* Protects the fields below. */
+	struct list partial;                /* Slabs with some objects free. */
+	struct slab *spare;                 /* A slab with all objects free. */
+	struct slab_magazine mag;           /* Only touched with interrupts off. */
+};
+
+void slab_cache_init (struct slab_cache *, const char *name, size_t obj_size);
+void *slab_alloc (struct slab_cache *);
+void slab_free (struct slab_cache *, void *);
+
+#endif /* threads/slab.h */
@@ -0,0 +1,28 @@
+#ifndef THREADS_SWITCH_H
+#define THREADS_SWITCH_H
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+/* switch_threads()'s stack frame, as saved on the stack of a
+   thread that is switched out. */
+struct switch_threads_frame {
+	uint64_t r15;
+	uint64_t r14;               /* switch_entry(): kernel_thread(). */
+	uint64_t r13;               /* switch_entry(): aux. */
+	uint64_t r12;               /* switch_entry(): function. */
+	uint64_t rbp;
+	uint64_t rbx;
+	void (*rip) (void);         /* Return address. */
+};
+
+/* Saves the callee-saved registers and stack pointer of the
+   running thread to *PREV_RSP and resumes the thread whose
+   stack pointer is NEXT_RSP. */
+void switch_threads (uintptr_t *prev_rsp, uintptr_t next_rsp);
+
+/* Entry point of a new thread. */
+void switch_entry (void);
+#endif
+
+#endif /* threads/switch.h */
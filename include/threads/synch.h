@@ -3,12 +3,40 @@
 
 #include <list.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <debug.h>
 
+/* Queue of threads waiting on a synchronization object.  Pops
+   the highest-priority thread, or the earliest arrival among
+   threads of equal priority.  A pairing heap: push is O(1), pop
+   and re-keying (a remove plus a push) are O(log n) amortized. */
+struct waitq {
+	struct waitq_elem *root;    /* First thread to wake. */
+	unsigned long seq;          /* Arrival counter. */
+};
+
+/* Wait queue element, embedded in struct thread. */
+struct waitq_elem {
+	struct waitq_elem *child;   /* Leftmost child. */
+	struct waitq_elem *next;    /* Right sibling. */
+	struct waitq_elem *prev;    /* Left sibling, or parent. */
+	struct waitq *q;            /* Queue it is in, or null. */
+	unsigned long seq;          /* Arrival order in Q. */
+};
+
+struct thread;
+void waitq_init (struct waitq *);
+bool waitq_empty (const struct waitq *);
+void waitq_push (struct waitq *, struct thread *);
+struct thread *waitq_first (const struct waitq *);
+struct thread *waitq_pop (struct waitq *);
+void waitq_remove (struct thread *);
+void waitq_update (struct thread *);
+
 /* A counting semaphore. */
 struct semaphore {
 	unsigned value;             /* Current value. */
-	struct list waiters;        /* List of waiting threads. */
+	struct waitq waiters;       /* Waiting threads. */
 };
 
 void sema_init (struct semaphore *, unsigned value);
@@ -17,21 +45,108 @@ bool sema_try_down (struct semaphore *);
 void sema_up (struct semaphore *);
 void sema_self_test (void);
 
+/* Priority donated through a lock, mutex or reader-writer lock:
+   the highest priority among the threads waiting for it.  While
+   such an object is held and has waiters, its donation sits in a
+   heap in its holder, so the holder finds its highest donation
+   without looking at any waiter.  The heap is a pairing heap
+   linked through the donations themselves, so a thread can hold
+   any number of them. */
+struct donation {
+	int priority;               /* Highest priority among waiters. */
+	bool held;                  /* In its holder's heap? */
+	struct donation *child;     /* Leftmost child. */
+	struct donation *next;      /* Right sibling. */
+	struct donation *prev;      /* Left sibling, or parent. */
+};
+
 /* Lock. */
 struct lock {
 	struct thread *holder;      /* Thread holding lock (for debugging). */
 	struct semaphore semaphore; /* Binary semaphore controlling access. */
+	struct donation donation;   /* Donation to the holder. */
+	struct lock_stat *stat;     /* Contention statistics, or null. */
+	uint64_t acquired_at;       /* When acquired, for statistics. */
 };
 
-void lock_init (struct lock *);
+void lock_init_named (struct lock *, const char *name);
 void lock_acquire (struct lock *);
 bool lock_try_acquire (struct lock *);
 void lock_release (struct lock *);
 bool lock_held_by_current_thread (const struct lock *);
 
+/* Initializes LOCK, naming it after its own expression. */
+#define lock_init(LOCK) lock_init_named (LOCK, #LOCK)
+
+/* Mutex.  Like a lock, but acquired and released with a single
+   atomic instruction when nobody waits.  A contended mutex_lock()
+   sleeps right away; it does not spin.  Suited to short critical
+   sections. */
+struct mutex {
+	uintptr_t owner;            /* Owning thread | MUTEX_WAITERS. */
+	struct waitq waiters;       /* Threads sleeping on the mutex. */
+	struct donation donation;   /* Donation to the owner. */
+	struct lock_stat *stat;     /* Contention statistics, or null. */
+	uint64_t acquired_at;       /* When acquired, for statistics. */
+};
+
+/* Set in a mutex's owner word while threads sleep on it. */
+#define MUTEX_WAITERS ((uintptr_t) 1)
+
+void mutex_init_named (struct mutex *, const char *name);
+void mutex_lock (struct mutex *);
+bool mutex_try_lock (struct mutex *);
+void mutex_unlock (struct mutex *);
+bool mutex_held_by_current_thread (const struct mutex *);
+
+/* Initializes mutex M, naming it after its own expression. */
+#define mutex_init(M) mutex_init_named (M, #M)
+
+/* Lock contention profiling.  If lock_profile is true, locks and
+   mutexes initialized afterward count their acquisitions, waits
+   and hold times, summed over all locks of the same name.
+   Controlled by kernel command-line option "-lockstat". */
+extern bool lock_profile;
+void lock_print_stats (void);
+
+/* Reader-writer lock.  Held either by one writer or by any
+   number of readers.  Once a writer waits, new readers wait
+   behind it, and a writer's release admits all readers waiting
+   at that point, so neither side starves.  Not recursive. */
+struct rwlock {
+	struct thread *writer;      /* Thread holding it for writing. */
+	struct list readers;        /* Holds of the readers holding it. */
+	struct waitq read_waiters;  /* Threads waiting to read. */
+	struct waitq write_waiters; /* Threads waiting to write. */
+	struct donation donation;   /* Donation to the writer. */
+};
+
+void rwlock_init (struct rwlock *);
+void rwlock_read_acquire (struct rwlock *);
+void rwlock_read_release (struct rwlock *);
+void rwlock_write_acquire (struct rwlock *);
+void rwlock_write_release (struct rwlock *);
+bool rwlock_held_by_current_thread (const struct rwlock *);
+
+/* A thread's hold on a rwlock it holds for reading.  Waiting
+   threads donate to each reader through its hold, as they do to
+   a lock holder through the lock. */
+struct rwlock_hold {
+	struct rwlock *rw;          /* Rwlock held, or null if unused. */
+	struct thread *reader;      /* Thread holding it. */
+	struct list_elem elem;      /* Element in rw->readers. */
+	struct donation donation;   /* Donation to the reader. */
+};
+
+/* Number of rwlocks a thread can hold for reading at once.  The
+   file system nests at most two (dir_lock with an inode's rw or
+   open_inodes_lock).  A thread without a free hold takes the
+   rwlock for writing instead. */
+#define RWLOCK_HOLDS_MAX 8
+
 /* Condition variable. */
 struct condition {
-	struct list waiters;        /* List of waiting threads. */
+	struct waitq waiters;       /* Waiting threads. */
 };
 
 void cond_init (struct condition *);
@@ -39,11 +154,6 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
-/* Comparator. */
-bool cmp_sema_waiters_priorities (const struct list_elem *, 
-							const struct list_elem *,
-							void *aux UNUSED);
-							
 /* Optimization barrier.
  *
  * The compiler will not reorder operations across an
@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <fixed.h>
 #include "threads/interrupt.h"
+#include "threads/synch.h"
 #ifdef VM
 #include "vm/vm.h"
 #endif
@@ -32,6 +33,20 @@ typedef int tid_t;
 /* Scheduling. */
 #define TIME_SLICE 4            /* # of timer ticks to give each thread. */
 
+/* Per-thread scheduling statistics.  Sampled with the TSC in
+   schedule(); see thread_print_sched_stats(). */
+struct thread_sched_stats {
+	uint64_t nvcsw;                     /* Switches out while blocking. */
+	uint64_t nivcsw;                    /* Switches out while runnable. */
+	uint64_t run_cycles;                /* Time spent running. */
+	uint64_t wait_cycles;               /* Time spent in the run queue. */
+	uint64_t max_latency;               /* Worst wakeup-to-run time. */
+	uint64_t run_start;                 /* When last switched in. */
+	uint64_t ready_start;               /* When last made ready. */
+	uint64_t wakeup;                    /* When last unblocked, or 0. */
+	bool preempted;                     /* Switching out involuntarily? */
+};
+
 /* A kernel thread or user process.
  *
  * Each thread structure is stored in its own 4 kB page.  The
@@ -56,7 +71,7 @@ typedef int tid_t;
  *           |                                 |
  *           +---------------------------------+
  *           |              magic              |
- *           |            intr_frame           |
+ *           |               rsp               |
  *           |                :                |
  *           |                :                |
  *           |               name              |
@@ -99,26 +114,38 @@ struct thread {
 	int64_t parked;						/* Parked ticks. */
 	/* Shared between thread.c and synch.c. */
 	struct list_elem elem;              /* List element. */
-	struct list donations;				/* Donation list. */
-	struct list_elem delem;				/* Donation list element. */
+	struct waitq_elem wq_elem;          /* Wait queue element. */
+	struct donation *held;				/* Heap of donations, or null. */
 	struct lock *lock;					/* Lock this thread waits. */
+	struct mutex *mutex;				/* Mutex this thread waits. */
+	struct rwlock *rwlock;				/* Rwlock this thread waits. */
+	struct rwlock_hold read_holds[RWLOCK_HOLDS_MAX]; /* Read holds. */
 	/* BSD Scheduling */
 	struct list_elem telem;				/* Thread list element. */
+	struct list_elem hash_elem;			/* Tid hash table element. */
 	int nice;							/* Niceness */
 	fixed recent_cpu;					/* Recent CPU time. */
+	int64_t decay_epoch;				/* Decays applied to recent_cpu. */
 	/* RSP in context changing. */
 	uintptr_t intr_rsp;
+	/* Scheduling statistics, in TSC cycles. */
+	struct thread_sched_stats stats;
 #ifdef USERPROG
 	/* Owned by userprog/process.c. */
 	uint64_t *pml4;                     /* Page map level 4 */
+	/* Owned by userprog/fpu.c. */
+	void *fpu;                          /* FPU/SSE save area, or NULL. */
+	/* Owned by userprog/task.c. */
+	struct task *task;                  /* Process run by this thread. */
+	bool killed;                        /* Exit on return to user mode? */
 #endif
 #ifdef VM
-	/* Table for whole virtual memory owned by thread. */
-	struct supplemental_page_table spt;
+	/* Table for whole virtual memory, shared by the process's threads. */
+	struct supplemental_page_table *spt;
 #endif
 
 	/* Owned by thread.c. */
-	struct intr_frame tf;               /* Information for switching */
+	uintptr_t rsp;                      /* Saved stack pointer. */
 	unsigned magic;                     /* Detects stack overflow. */
 };
 
@@ -127,13 +154,31 @@ struct thread {
    Controlled by kernel command-line option "-o mlfqs". */
 extern bool thread_mlfqs;
 
+/* If true, print per-thread scheduling statistics at shutdown.
+   Controlled by kernel command-line option "-schedstats". */
+extern bool thread_sched_stats;
+
+/* How an idle CPU waits for work.
+   Controlled by kernel command-line option "-idle=MODE". */
+enum idle_mode {
+	IDLE_HLT,                           /* Halt until an interrupt (default). */
+	IDLE_MWAIT,                         /* Monitor the run queue and MWAIT. */
+	IDLE_POLL                           /* Spin on the run queue. */
+};
+extern enum idle_mode thread_idle_mode;
+
 void thread_init (void);
 void thread_start (void);
 
 void thread_tick (void);
+void thread_account_ticks (int64_t n);
+int64_t thread_next_tick (int64_t now);
 void thread_park (int64_t start, int64_t ticks);
 void thread_try_unpark (int64_t ticks);
 void thread_print_stats (void);
+void thread_print_idle_stats (void);
+void thread_print_sched_stats (void);
+size_t thread_cache_shrink (void);
 
 typedef void thread_func (void *aux);
 tid_t thread_create (const char *name, int priority, 
@@ -150,8 +195,10 @@ const char *thread_name (void);
 
 void thread_exit (void) NO_RETURN;
 void thread_yield (void);
+void thread_preempt (void);
 bool thread_yield_if (bool predicate);
 bool thread_yield_priority (void);
+void thread_change_priority (struct thread *, int priority);
 
 int thread_get_priority (void);
 void thread_set_priority (int);
@@ -165,13 +212,10 @@ int thread_get_load_avg (void);
 void thread_update_load_avg (void);
 void thread_update_priority (struct thread* thrd);
 fixed get_decay (void);
-void thread_update_priority_all (void);
-void thread_update_recent_cpu_all (void);
+void thread_decay_recent_cpu (void);
 void thread_increase_recent_cpu (struct thread* thrd);
 struct thread *thread_find (tid_t tid);
 void do_iret (struct intr_frame *tf);
 bool cmp_thrd_priorities (const struct list_elem *, 
 					const struct list_elem *, void *aux UNUSED);
-bool cmp_thrd_donation_priorities (const struct list_elem *, 
-					const struct list_elem *, void *aux UNUSED);
 #endif /* threads/thread.h */
@@ -0,0 +1,13 @@
+#ifndef USERPROG_FPU_H
+#define USERPROG_FPU_H
+
+#include <stdbool.h>
+#include "threads/thread.h"
+
+void fpu_init (void);
+void fpu_activate (struct thread *next);
+bool fpu_copy (struct thread *dst, struct thread *src);
+void fpu_release (struct thread *);
+void fpu_print_stats (void);
+
+#endif /* userprog/fpu.h */
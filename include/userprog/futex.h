@@ -0,0 +1,11 @@
+#ifndef USERPROG_FUTEX_H
+#define USERPROG_FUTEX_H
+
+#include <stdint.h>
+
+void futex_init (void);
+int futex_wait (const int *uaddr, int expected);
+int futex_wake (const int *uaddr, int cnt);
+void futex_cancel (uint64_t *pml4);
+
+#endif /* userprog/futex.h */
@@ -15,13 +15,12 @@ struct lazy_load_args {
     bool writable;
 };
 
-struct lock process_filesys_lock;
-
 void process_init (void);
 pid_t process_create_initd (const char *file_name);
 pid_t process_fork (const char *name, struct intr_frame *if_);
 int process_exec (void *f_name);
 int process_wait (pid_t);
+tid_t process_thread_create (void *entry, void *arg0, void *arg1);
 void process_exit (void);
 void process_activate (struct thread *next);
 
@@ -1,6 +1,7 @@
 #ifndef USERPROG_TASK_H
 #define USERPROG_TASK_H
 #include <stdbool.h>
+#include <hash.h>
 #include <list.h>
 #include "threads/thread.h"
 #include "threads/synch.h"
@@ -12,6 +13,7 @@ typedef int pid_t;
 typedef int fd_t;
 
 #define MAX_FD 64
+#define TASK_THREAD_MAX 32      /* Threads per process besides the main one. */
 #define PID_ERROR ((pid_t)-1)
 #define FD_ERROR ((fd_t)-1)
 
@@ -36,14 +38,39 @@ enum process_status {
 	PROCESS_MAX
 };
 
+/* A thread of a process created by thread_create(), as opposed
+   to the process's main thread. */
+struct task_thread {
+	tid_t tid;                  /* Thread ID. */
+	struct thread *thread;      /* The thread, or NULL once it exits. */
+	struct task *task;          /* Process the thread belongs to. */
+	int slot;                   /* Index of the thread's user stack. */
+	bool joined;                /* Has thread_join() been called? */
+	struct semaphore started;   /* Upped once TID is set. */
+	struct semaphore exited;    /* Upped when the thread exits. */
+	struct list_elem elem;      /* Element in the task's thread list. */
+	void *entry;                /* User code the thread starts in. */
+	void *args[2];              /* Arguments passed to ENTRY. */
+};
+
+/* Entry of an id-to-task table. */
+struct task_id {
+	int id;                     /* Process or thread ID. */
+	struct hash_elem elem;      /* Hash table element. */
+};
+
 struct task {
 	char *name;                 /* Name of the process. */
 	pid_t pid;                  /* Process ID. */
 	tid_t tid;                  /* Thread ID. */
-	struct thread *thread;      /* The thread currently running the task. */
+	struct thread *thread;      /* Main thread of the process. */
 	pid_t parent_pid;           /* PID of parent process. */
 	struct list_elem elem;      /* List element for PCB */
+	struct task_id pid_entry;   /* Entry in the table of pids. */
+	struct task_id tid_entry;   /* Entry in the table of tids. */
 	struct list_elem celem;     /* List element for child process. */
+	struct lock fd_lock;        /* Protects fds and the positions of
+	                               their files. */
 	struct fd fds[MAX_FD];      /* File descriptor table. */
 	struct semaphore fork_lock; /* Lock for fork system call. */
 	struct semaphore wait_lock; /* Lock for wait system call. */
@@ -54,6 +81,13 @@ struct task {
 	int exit_code;              /* Exit code. */
 	void *args;                 /* Temporary argument for deterministic
 	                               creation of processes. */
+	struct lock threads_lock;   /* Protects the members below. */
+	struct list threads;        /* task_threads not yet joined. */
+	int thread_cnt;             /* Of those, threads still running. */
+	uint32_t stack_slots;       /* User stacks in use, one bit each. */
+	bool exiting;               /* Are the threads being killed? */
+	bool reaping;               /* Is the main thread waiting for them? */
+	struct semaphore threads_done; /* Upped when the last one exits. */
 };
 
 void task_init (void);
@@ -66,6 +100,14 @@ void task_file_cleanup (struct task *t);
 size_t task_child_len (struct task *t);
 void task_fork_fd (struct task *parent, struct task *child);
 void task_exit (int status);
+struct task_thread *task_thread_add (struct task *task);
+void task_thread_discard (struct task_thread *tt);
+void task_thread_start (struct task_thread *tt);
+void task_thread_exit (struct task *task);
+int task_thread_join (struct task *task, tid_t tid);
+void task_reap_threads (struct task *task, bool kill);
+void task_fork_stack (struct task *parent, struct task *child,
+		struct thread *forker);
 struct task *task_find_by_pid (pid_t pid);
 struct task *task_find_by_tid (tid_t tid); 
 fd_t task_find_original_fd (struct task* task, int fd);
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <hash.h>
 #include "threads/palloc.h"
+#include "threads/synch.h"
 
 #define MAX_STACK_SIZE (1 << 20)	/* 1 MB */
 enum vm_type {
@@ -93,6 +94,8 @@ struct page_operations {
  * All designs up to you for this. */
 struct supplemental_page_table {
 	struct hash page_map;
+	struct lock lock;      /* Serializes the threads of the process. */
+	int tid;               /* Main thread of the process. */
 };
 
 #include "threads/thread.h"
@@ -119,4 +122,9 @@ enum vm_type page_get_type (struct page *page);
 struct frame *frame_get (void);
 void frame_return (struct frame *frame);
 void vm_free_frame (struct frame *frame, bool cleanup);
+
+/* Cache of struct lazy_load_args, the aux of lazily loaded pages.
+   See threads/slab.h. */
+struct slab_cache;
+extern struct slab_cache lazy_load_slab;
 #endif  /* VM_VM_H */
@@ -2,8 +2,16 @@
 
 int main (int, char *[]);
 void _start (int argc, char *argv[]);
+void _thread_start (thread_func *, void *aux);
 
 void
 _start (int argc, char *argv[]) {
 	exit (main (argc, argv));
 }
+
+/* Where threads made by thread_create() begin. */
+void
+_thread_start (thread_func *func, void *aux) {
+	func (aux);
+	thread_exit ();
+}
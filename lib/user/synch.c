@@ -0,0 +1,97 @@
+#include <synch.h>
+#include <limits.h>
+#include <syscall.h>
+
+/* Mutex states. */
+#define UNLOCKED 0              /* Free. */
+#define LOCKED 1                /* Held, nobody sleeping. */
+#define CONTENDED 2             /* Held, threads may be sleeping. */
+
+/* Atomically replaces *P by NEW if it equals OLD.  Returns the
+   value *P had. */
+static int
+cas (int *p, int old, int new) {
+	__atomic_compare_exchange_n (p, &old, new, false,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+	return old;
+}
+
+/* Initializes M as unlocked. */
+void
+mutex_init (struct mutex *m) {
+	m->state = UNLOCKED;
+}
+
+/* Acquires M, sleeping in the kernel while another thread holds
+   it.  This is the three-state mutex from Drepper, "Futexes Are
+   Tricky": a thread that has to sleep marks M as CONTENDED, so
+   that mutex_unlock() knows to make a system call. */
+void
+mutex_lock (struct mutex *m) {
+	int c = cas (&m->state, UNLOCKED, LOCKED);
+
+	if (c == UNLOCKED)
+		return;
+	if (c != CONTENDED)
+		c = __atomic_exchange_n (&m->state, CONTENDED, __ATOMIC_ACQUIRE);
+	while (c != UNLOCKED) {
+		futex_wait (&m->state, CONTENDED);
+		c = __atomic_exchange_n (&m->state, CONTENDED, __ATOMIC_ACQUIRE);
+	}
+}
+
+/* Acquires M if it is free and returns true, or returns false
+   without waiting. */
+bool
+mutex_trylock (struct mutex *m) {
+	return cas (&m->state, UNLOCKED, LOCKED) == UNLOCKED;
+}
+
+/* Releases M, waking one sleeping thread if there may be one. */
+void
+mutex_unlock (struct mutex *m) {
+	if (__atomic_exchange_n (&m->state, UNLOCKED, __ATOMIC_RELEASE)
+			== CONTENDED)
+		futex_wake (&m->state, 1);
+}
+
+/* Initializes condition variable CV. */
+void
+cond_init (struct condvar *cv) {
+	cv->seq = 0;
+}
+
+/* Atomically releases M and waits for CV to be signaled, then
+   reacquires M.  M must be held.  As with any condition variable,
+   the caller should recheck its condition in a loop. */
+void
+cond_wait (struct condvar *cv, struct mutex *m) {
+	int seq = __atomic_load_n (&cv->seq, __ATOMIC_RELAXED);
+
+	mutex_unlock (m);
+
+	/* A signal between the unlock and the wait changes SEQ, so
+	   futex_wait() returns at once instead of missing it. */
+	futex_wait (&cv->seq, seq);
+
+	/* Other threads may have been woken by the same broadcast,
+	   so take M as contended to make sure they are passed it in
+	   turn. */
+	while (__atomic_exchange_n (&m->state, CONTENDED, __ATOMIC_ACQUIRE)
+			!= UNLOCKED)
+		futex_wait (&m->state, CONTENDED);
+}
+
+/* Wakes one thread waiting on CV, if any. */
+void
+cond_signal (struct condvar *cv) {
+	__atomic_fetch_add (&cv->seq, 1, __ATOMIC_RELEASE);
+	futex_wake (&cv->seq, 1);
+}
+
+/* Wakes all threads waiting on CV. */
+void
+cond_broadcast (struct condvar *cv) {
+	__atomic_fetch_add (&cv->seq, 1, __ATOMIC_RELEASE);
+	futex_wake (&cv->seq, INT_MAX);
+}
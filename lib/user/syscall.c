@@ -194,3 +194,32 @@ int
 umount (const char *path) {
 	return syscall1 (SYS_UMOUNT, path);
 }
+
+int
+futex_wait (const int *uaddr, int expected) {
+	return syscall2 (SYS_FUTEX_WAIT, uaddr, expected);
+}
+
+int
+futex_wake (const int *uaddr, int cnt) {
+	return syscall2 (SYS_FUTEX_WAKE, uaddr, cnt);
+}
+
+/* In entry.c. */
+void _thread_start (thread_func *, void *aux);
+
+tid_t
+thread_create (thread_func *func, void *aux) {
+	return syscall3 (SYS_THREAD_CREATE, _thread_start, func, aux);
+}
+
+int
+thread_join (tid_t tid) {
+	return syscall1 (SYS_THREAD_JOIN, tid);
+}
+
+void
+thread_exit (void) {
+	syscall0 (SYS_THREAD_EXIT);
+	NOT_REACHED ();
+}
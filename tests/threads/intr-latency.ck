@@ -0,0 +1,23 @@
+# -*- perl -*-
+
+# The expected output looks like this, with a varying number:
+#
+# (intr-latency) begin
+# (intr-latency) Longest interrupts-off window: 38 us.
+# (intr-latency) It was opened at 0x8004207a3c and closed at 0x8004208b10.
+# (intr-latency) end
+
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test);
+my (@output) = read_text_file ("$test.output");
+
+common_checks ("run", @output);
+
+fail "Interrupts-off window missing from output.\n"
+  if !grep (/^\(intr-latency\) Longest interrupts-off window: \d+ us\.$/,
+	    @output);
+
+pass;
@@ -0,0 +1,120 @@
+/* The main thread acquires a lock, and a reader-writer lock for
+   reading.  A higher-priority reader then shares the rwlock
+   without waiting, and a thread of the same priority blocks on
+   the lock.  A still higher-priority writer blocks on the rwlock
+   and donates its priority to the main thread, which keeps it
+   after releasing the lock and gives it back when it releases
+   the rwlock.
+
+   Then the main thread reads a second rwlock, and a writer
+   blocks on it, followed by a still higher-priority reader that
+   has to queue behind the writer.  When the main thread releases
+   the rwlock, the writer gets it and must run with the queued
+   reader's priority. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+static thread_func reader_thread_func;
+static thread_func writer_thread_func;
+static thread_func acquirer_thread_func;
+static thread_func reader2_thread_func;
+static thread_func writer2_thread_func;
+
+void
+test_priority_donate_rwlock (void) 
+{
+  struct rwlock rw, rw2;
+  struct lock lock;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  /* Make sure our priority is the default. */
+  ASSERT (thread_get_priority () == PRI_DEFAULT);
+
+  rwlock_init (&rw);
+  lock_init (&lock);
+  lock_acquire (&lock);
+  rwlock_read_acquire (&rw);
+  thread_create ("reader", PRI_DEFAULT + 1, reader_thread_func, &rw);
+  thread_create ("acquirer", PRI_DEFAULT + 1, acquirer_thread_func, &lock);
+  thread_create ("writer", PRI_DEFAULT + 2, writer_thread_func, &rw);
+  msg ("This thread should have priority %d.  Actual priority: %d.",
+       PRI_DEFAULT + 2, thread_get_priority ());
+  lock_release (&lock);
+  msg ("This thread should have priority %d.  Actual priority: %d.",
+       PRI_DEFAULT + 2, thread_get_priority ());
+  rwlock_read_release (&rw);
+  msg ("This thread should have priority %d.  Actual priority: %d.",
+       PRI_DEFAULT, thread_get_priority ());
+
+  rwlock_init (&rw2);
+  rwlock_read_acquire (&rw2);
+  thread_create ("writer 2", PRI_DEFAULT + 1, writer2_thread_func, &rw2);
+  thread_create ("reader 2", PRI_DEFAULT + 2, reader2_thread_func, &rw2);
+  msg ("This thread should have priority %d.  Actual priority: %d.",
+       PRI_DEFAULT + 2, thread_get_priority ());
+  rwlock_read_release (&rw2);
+  msg ("This thread should have priority %d.  Actual priority: %d.",
+       PRI_DEFAULT, thread_get_priority ());
+}
+
+static void
+reader_thread_func (void *rw_) 
+{
+  struct rwlock *rw = rw_;
+
+  rwlock_read_acquire (rw);
+  msg ("reader: got the lock for reading");
+  rwlock_read_release (rw);
+  msg ("reader: done");
+}
+
+static void
+writer_thread_func (void *rw_) 
+{
+  struct rwlock *rw = rw_;
+
+  rwlock_write_acquire (rw);
+  msg ("writer: got the lock for writing");
+  rwlock_write_release (rw);
+  msg ("writer: done");
+}
+
+static void
+acquirer_thread_func (void *lock_) 
+{
+  struct lock *lock = lock_;
+
+  lock_acquire (lock);
+  msg ("acquirer: got the lock");
+  lock_release (lock);
+  msg ("acquirer: done");
+}
+
+static void
+reader2_thread_func (void *rw_) 
+{
+  struct rwlock *rw = rw_;
+
+  rwlock_read_acquire (rw);
+  msg ("reader 2: got the lock for reading");
+  rwlock_read_release (rw);
+  msg ("reader 2: done");
+}
+
+static void
+writer2_thread_func (void *rw_) 
+{
+  struct rwlock *rw = rw_;
+
+  rwlock_write_acquire (rw);
+  msg ("writer 2: got the lock for writing at priority %d",
+       thread_get_priority ());
+  rwlock_write_release (rw);
+  msg ("writer 2: done");
+}
@@ -0,0 +1,24 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(priority-donate-rwlock) begin
+(priority-donate-rwlock) reader: got the lock for reading
+(priority-donate-rwlock) reader: done
+(priority-donate-rwlock) This thread should have priority 33.  Actual priority: 33.
+(priority-donate-rwlock) This thread should have priority 33.  Actual priority: 33.
+(priority-donate-rwlock) writer: got the lock for writing
+(priority-donate-rwlock) writer: done
+(priority-donate-rwlock) acquirer: got the lock
+(priority-donate-rwlock) acquirer: done
+(priority-donate-rwlock) This thread should have priority 31.  Actual priority: 31.
+(priority-donate-rwlock) This thread should have priority 33.  Actual priority: 33.
+(priority-donate-rwlock) writer 2: got the lock for writing at priority 33
+(priority-donate-rwlock) reader 2: got the lock for reading
+(priority-donate-rwlock) reader 2: done
+(priority-donate-rwlock) writer 2: done
+(priority-donate-rwlock) This thread should have priority 31.  Actual priority: 31.
+(priority-donate-rwlock) end
+EOF
+pass;
@@ -0,0 +1,51 @@
+/* Measures how many thread switches per second the scheduler
+   can perform.  Two threads of equal priority yield to each
+   other SWITCH_CNT / 2 times each, so that every yield is a
+   switch from one to the other. */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+#include "intrinsic.h"
+
+#define SWITCH_CNT 100000
+
+static thread_func switch_rate_thread;
+static struct semaphore done;
+
+void
+test_switch_rate (void) 
+{
+  uint64_t start, us;
+  int i;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  sema_init (&done, 0);
+  thread_create ("partner", PRI_DEFAULT, switch_rate_thread, NULL);
+
+  start = rdtsc ();
+  for (i = 0; i < SWITCH_CNT / 2; i++)
+    thread_yield ();
+  sema_down (&done);
+  us = timer_tsc_to_us (rdtsc () - start);
+
+  msg ("%d switches in %"PRIu64" us.", SWITCH_CNT, us);
+  msg ("%"PRIu64" switches per second.",
+       us != 0 ? (uint64_t) SWITCH_CNT * 1000000 / us : 0);
+}
+
+static void
+switch_rate_thread (void *aux UNUSED) 
+{
+  int i;
+
+  for (i = 0; i < SWITCH_CNT / 2; i++)
+    thread_yield ();
+  sema_up (&done);
+}
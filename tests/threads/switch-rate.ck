@@ -0,0 +1,24 @@
+# -*- perl -*-
+
+# The expected output looks like this, with varying numbers:
+#
+# (switch-rate) begin
+# (switch-rate) 100000 switches in 52341 us.
+# (switch-rate) 1910548 switches per second.
+# (switch-rate) end
+
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test);
+my (@output) = read_text_file ("$test.output");
+
+common_checks ("run", @output);
+
+fail "Switch count missing from output.\n"
+  if !grep (/^\(switch-rate\) 100000 switches in \d+ us\.$/, @output);
+fail "Switch rate missing from output.\n"
+  if !grep (/^\(switch-rate\) \d+ switches per second\.$/, @output);
+
+pass;
@@ -0,0 +1,31 @@
+/* Checks the futex system calls and the user-level mutex and
+   condition variable built on them, without contention: a wait
+   on a word that does not hold the expected value returns at
+   once, a wake with no waiters wakes nobody, and a mutex can be
+   locked, tried, and unlocked without sleeping. */
+
+#include <synch.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static int word = 7;
+
+void
+test_main (void)
+{
+  struct mutex m;
+  struct condvar cv;
+
+  CHECK (futex_wait (&word, 8) == -1, "futex_wait on changed word");
+  CHECK (futex_wake (&word, 1) == 0, "futex_wake without waiters");
+
+  mutex_init (&m);
+  cond_init (&cv);
+  mutex_lock (&m);
+  CHECK (!mutex_trylock (&m), "mutex_trylock on held mutex");
+  cond_signal (&cv);
+  mutex_unlock (&m);
+  CHECK (mutex_trylock (&m), "mutex_trylock on free mutex");
+  mutex_unlock (&m);
+}
@@ -0,0 +1,46 @@
+/* Has several threads sleep in futex_wait() on a word that keeps
+   its expected value, so only futex_wake() can return them, and
+   wakes them all.  Checks that each waiter returns 0 and that no
+   waiter is left afterward. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define WAITER_CNT 3
+
+static int word;
+static int results[WAITER_CNT];
+
+static void
+waiter (void *result_)
+{
+  int *result = result_;
+
+  *result = futex_wait (&word, 0);
+}
+
+void
+test_main (void)
+{
+  tid_t tids[WAITER_CNT];
+  int woken = 0;
+
+  for (int i = 0; i < WAITER_CNT; i++)
+    {
+      results[i] = -2;
+      CHECK ((tids[i] = thread_create (waiter, &results[i])) != TID_ERROR,
+             "create waiter %d", i);
+    }
+
+  /* A wake finds a waiter only once it sleeps. */
+  while (woken < WAITER_CNT)
+    woken += futex_wake (&word, WAITER_CNT - woken);
+  msg ("woke %d waiters", woken);
+
+  for (int i = 0; i < WAITER_CNT; i++)
+    CHECK (thread_join (tids[i]) == 0, "join waiter %d", i);
+  for (int i = 0; i < WAITER_CNT; i++)
+    CHECK (results[i] == 0, "waiter %d returned 0", i);
+  CHECK (futex_wake (&word, 1) == 0, "futex_wake without waiters");
+}
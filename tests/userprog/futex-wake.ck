@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(futex-wake) begin
+(futex-wake) create waiter 0
+(futex-wake) create waiter 1
+(futex-wake) create waiter 2
+(futex-wake) woke 3 waiters
+(futex-wake) join waiter 0
+(futex-wake) join waiter 1
+(futex-wake) join waiter 2
+(futex-wake) waiter 0 returned 0
+(futex-wake) waiter 1 returned 0
+(futex-wake) waiter 2 returned 0
+(futex-wake) futex_wake without waiters
+(futex-wake) end
+futex-wake: exit(0)
+EOF
+pass;
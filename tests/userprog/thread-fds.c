@@ -0,0 +1,76 @@
+/* Has several threads read one shared file descriptor a byte at
+   a time while another thread keeps opening and closing files,
+   and checks that every byte of the file was read exactly once. */
+
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define READER_CNT 4
+#define OPEN_CNT 200
+
+struct result
+  {
+    int cnt;            /* Bytes read. */
+    int sum;            /* Sum of the bytes read. */
+  };
+
+static int fd;
+static struct result results[READER_CNT];
+static int open_failures;
+
+static void
+reader (void *result_)
+{
+  struct result *result = result_;
+  char c;
+
+  while (read (fd, &c, 1) == 1)
+    {
+      result->cnt++;
+      result->sum += (unsigned char) c;
+    }
+}
+
+static void
+opener (void *aux UNUSED)
+{
+  for (int i = 0; i < OPEN_CNT; i++)
+    {
+      int fd2 = open ("sample.txt");
+      if (fd2 < 2)
+        open_failures++;
+      else
+        close (fd2);
+    }
+}
+
+void
+test_main (void)
+{
+  tid_t tids[READER_CNT + 1];
+  int cnt = 0, sum = 0, expected_sum = 0;
+
+  for (size_t i = 0; i < sizeof sample - 1; i++)
+    expected_sum += (unsigned char) sample[i];
+
+  CHECK ((fd = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK ((tids[READER_CNT] = thread_create (opener, NULL)) != TID_ERROR,
+         "create opener");
+  for (int i = 0; i < READER_CNT; i++)
+    CHECK ((tids[i] = thread_create (reader, &results[i])) != TID_ERROR,
+           "create reader %d", i);
+  for (int i = 0; i <= READER_CNT; i++)
+    CHECK (thread_join (tids[i]) == 0, "join thread %d", i);
+
+  for (int i = 0; i < READER_CNT; i++)
+    {
+      cnt += results[i].cnt;
+      sum += results[i].sum;
+    }
+  CHECK (cnt == (int) sizeof sample - 1, "read every byte once");
+  CHECK (sum == expected_sum, "bytes match \"sample.txt\"");
+  CHECK (open_failures == 0, "opened and closed %d files", OPEN_CNT);
+  close (fd);
+}
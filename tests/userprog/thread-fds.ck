@@ -0,0 +1,24 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(thread-fds) begin
+(thread-fds) open "sample.txt"
+(thread-fds) create opener
+(thread-fds) create reader 0
+(thread-fds) create reader 1
+(thread-fds) create reader 2
+(thread-fds) create reader 3
+(thread-fds) join thread 0
+(thread-fds) join thread 1
+(thread-fds) join thread 2
+(thread-fds) join thread 3
+(thread-fds) join thread 4
+(thread-fds) read every byte once
+(thread-fds) bytes match "sample.txt"
+(thread-fds) opened and closed 200 files
+(thread-fds) end
+thread-fds: exit(0)
+EOF
+pass;
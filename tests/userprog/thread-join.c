@@ -0,0 +1,40 @@
+/* Starts several threads that share a counter guarded by a user
+   mutex, joins them all, and checks that no increment was lost.
+   Also checks that a thread cannot be joined twice. */
+
+#include <synch.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define THREAD_CNT 8
+#define ITER_CNT 1000
+
+static struct mutex mutex;
+static int counter;
+
+static void
+add (void *aux UNUSED)
+{
+  for (int i = 0; i < ITER_CNT; i++)
+    {
+      mutex_lock (&mutex);
+      counter++;
+      mutex_unlock (&mutex);
+    }
+}
+
+void
+test_main (void)
+{
+  tid_t tids[THREAD_CNT];
+
+  mutex_init (&mutex);
+  for (int i = 0; i < THREAD_CNT; i++)
+    CHECK ((tids[i] = thread_create (add, NULL)) != TID_ERROR,
+           "create thread %d", i);
+  for (int i = 0; i < THREAD_CNT; i++)
+    CHECK (thread_join (tids[i]) == 0, "join thread %d", i);
+  CHECK (thread_join (tids[0]) == -1, "join thread 0 again");
+  CHECK (counter == THREAD_CNT * ITER_CNT, "counter is %d", counter);
+}
@@ -0,0 +1,28 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(thread-join) begin
+(thread-join) create thread 0
+(thread-join) create thread 1
+(thread-join) create thread 2
+(thread-join) create thread 3
+(thread-join) create thread 4
+(thread-join) create thread 5
+(thread-join) create thread 6
+(thread-join) create thread 7
+(thread-join) join thread 0
+(thread-join) join thread 1
+(thread-join) join thread 2
+(thread-join) join thread 3
+(thread-join) join thread 4
+(thread-join) join thread 5
+(thread-join) join thread 6
+(thread-join) join thread 7
+(thread-join) join thread 0 again
+(thread-join) counter is 8000
+(thread-join) end
+thread-join: exit(0)
+EOF
+pass;
@@ -20,10 +20,12 @@
 #include "threads/mmu.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #include "userprog/exception.h"
+#include "userprog/fpu.h"
 #include "userprog/gdt.h"
 #include "userprog/syscall.h"
 #include "userprog/tss.h"
@@ -99,6 +101,7 @@ main (void) {
 	input_init ();
 #ifdef USERPROG
 	exception_init ();
+	fpu_init ();
 	syscall_init ();
 	process_init ();
 #endif
@@ -106,6 +109,7 @@ main (void) {
 	thread_start ();
 	serial_init_queue ();
 	timer_calibrate ();
+	palloc_zero_start ();
 
 #ifdef FILESYS
 	/* Initialize file system. */
@@ -222,6 +226,24 @@ parse_options (char **argv) {
 			random_init (atoi (value));
 		else if (!strcmp (name, "-mlfqs"))
 			thread_mlfqs = true;
+		else if (!strcmp (name, "-schedstats"))
+			thread_sched_stats = true;
+		else if (!strcmp (name, "-irqsoff"))
+			intr_off_trace = true;
+		else if (!strcmp (name, "-lockstat"))
+			lock_profile = true;
+		else if (!strcmp (name, "-tickless"))
+			timer_tickless = true;
+		else if (!strcmp (name, "-idle")) {
+			if (value != NULL && !strcmp (value, "hlt"))
+				thread_idle_mode = IDLE_HLT;
+			else if (value != NULL && !strcmp (value, "mwait"))
+				thread_idle_mode = IDLE_MWAIT;
+			else if (value != NULL && !strcmp (value, "poll"))
+				thread_idle_mode = IDLE_POLL;
+			else
+				PANIC ("unknown idle mode `%s' (use -h for help)", value);
+		}
 #ifdef USERPROG
 		else if (!strcmp (name, "-ul"))
 			user_page_limit = atoi (value);
@@ -327,6 +349,11 @@ usage (void) {
 			"  -f                 Format file system disk during startup.\n"
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
+			"  -schedstats        Print per-thread scheduling statistics at exit.\n"
+			"  -irqsoff           Record the longest interrupts-off window.\n"
+			"  -lockstat          Print the most contended locks at exit.\n"
+			"  -tickless          Stop the periodic timer tick when possible.\n"
+			"  -idle=MODE         Idle with MODE: hlt (default), mwait or poll.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
 #endif
@@ -355,6 +382,16 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	palloc_print_stats ();
+	malloc_print_stats ();
+	if (thread_sched_stats) {
+		thread_print_sched_stats ();
+		thread_print_idle_stats ();
+	}
+	if (intr_off_trace)
+		intr_print_stats ();
+	if (lock_profile)
+		lock_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
 #endif
@@ -362,5 +399,6 @@ print_stats (void) {
 	kbd_print_stats ();
 #ifdef USERPROG
 	exception_print_stats ();
+	fpu_print_stats ();
 #endif
 }
@@ -9,6 +9,7 @@
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "threads/vaddr.h"
+#include "devices/lapic.h"
 #include "devices/timer.h"
 #include "intrinsic.h"
 #ifdef USERPROG
@@ -103,6 +104,24 @@ static const char *intr_names[INTR_CNT];
 static bool in_external_intr;   /* Are we processing an external interrupt? */
 static bool yield_on_return;    /* Should we yield on interrupt return? */
 
+/* Interrupts-off window tracing.  If intr_off_trace is true, the
+   longest stretch of time with interrupts disabled is recorded,
+   together with the code that disabled and re-enabled them, as
+   return addresses that can be resolved with the backtrace tool.
+   Windows opened by the CPU on entry to an external interrupt
+   are attributed to the handler.
+   Controlled by kernel command-line option "-irqsoff". */
+bool intr_off_trace;
+static uint64_t off_start;      /* TSC when interrupts went off, or 0. */
+static void *off_site;          /* Where they went off. */
+static uint64_t off_max;        /* Longest window, in TSC cycles. */
+static void *off_max_start;     /* Where the longest window began. */
+static void *off_max_end;       /* Where the longest window ended. */
+
+static void off_begin (void *site);
+static void off_end (void *site);
+static enum intr_level set_level (enum intr_level, void *site);
+
 /* Programmable Interrupt Controller helpers. */
 static void pic_init (void);
 static void pic_end_of_interrupt (int irq);
@@ -128,37 +147,107 @@ intr_get_level (void) {
    returns the previous interrupt status. */
 enum intr_level
 intr_set_level (enum intr_level level) {
-	return level == INTR_ON ? intr_enable () : intr_disable ();
+	return set_level (level, __builtin_return_address (0));
 }
 
 /* Enables interrupts and returns the previous interrupt status. */
 enum intr_level
 intr_enable (void) {
-	enum intr_level old_level = intr_get_level ();
-	ASSERT (!intr_context ());
-
-	/* Enable interrupts by setting the interrupt flag.
-
-	   See [IA32-v2b] "STI" and [IA32-v3a] 5.8.1 "Masking Maskable
-	   Hardware Interrupts". */
-	asm volatile ("sti");
-
-	return old_level;
+	return set_level (INTR_ON, __builtin_return_address (0));
 }
 
 /* Disables interrupts and returns the previous interrupt status. */
 enum intr_level
 intr_disable (void) {
+	return set_level (INTR_OFF, __builtin_return_address (0));
+}
+
+/* Sets the interrupt status to LEVEL on behalf of the code at
+   SITE and returns the previous interrupt status. */
+static enum intr_level
+set_level (enum intr_level level, void *site) {
 	enum intr_level old_level = intr_get_level ();
 
-	/* Disable interrupts by clearing the interrupt flag.
-	   See [IA32-v2b] "CLI" and [IA32-v3a] 5.8.1 "Masking Maskable
-	   Hardware Interrupts". */
-	asm volatile ("cli" : : : "memory");
+	if (level == INTR_ON) {
+		ASSERT (!intr_context ());
+
+		if (intr_off_trace && old_level == INTR_OFF)
+			off_end (site);
+
+		/* Enable interrupts by setting the interrupt flag.
+
+		   See [IA32-v2b] "STI" and [IA32-v3a] 5.8.1 "Masking Maskable
+		   Hardware Interrupts". */
+		asm volatile ("sti");
+	} else {
+		/* Disable interrupts by clearing the interrupt flag.
+		   See [IA32-v2b] "CLI" and [IA32-v3a] 5.8.1 "Masking Maskable
+		   Hardware Interrupts". */
+		asm volatile ("cli" : : : "memory");
+
+		if (intr_off_trace && old_level == INTR_ON)
+			off_begin (site);
+	}
 
 	return old_level;
 }
 
+/* Starts an interrupts-off window at SITE. */
+static void
+off_begin (void *site) {
+	off_start = rdtsc ();
+	off_site = site;
+}
+
+/* Ends the current interrupts-off window, if any, at SITE. */
+static void
+off_end (void *site) {
+	uint64_t len;
+
+	if (off_start == 0)
+		return;
+
+	len = rdtsc () - off_start;
+	if (len > off_max) {
+		off_max = len;
+		off_max_start = off_site;
+		off_max_end = site;
+	}
+	off_start = 0;
+}
+
+/* Forgets the longest interrupts-off window recorded so far. */
+void
+intr_off_reset (void) {
+	enum intr_level old_level = intr_disable ();
+	off_max = 0;
+	off_max_start = off_max_end = NULL;
+	intr_set_level (old_level);
+}
+
+/* Returns the length, in TSC cycles, of the longest interrupts-off
+   window recorded, and stores where it began and ended in
+   *DISABLED_AT and *ENABLED_AT. */
+uint64_t
+intr_off_max (void **disabled_at, void **enabled_at) {
+	enum intr_level old_level = intr_disable ();
+	uint64_t max = off_max;
+	*disabled_at = off_max_start;
+	*enabled_at = off_max_end;
+	intr_set_level (old_level);
+	return max;
+}
+
+/* Prints interrupt statistics. */
+void
+intr_print_stats (void) {
+	void *disabled_at, *enabled_at;
+	uint64_t max = intr_off_max (&disabled_at, &enabled_at);
+
+	printf ("Interrupts: longest off window %'"PRIu64" us, from %p to %p\n",
+			timer_tsc_to_us (max), disabled_at, enabled_at);
+}
+
 /* Initializes the interrupt system. */
 void
 intr_init (void) {
@@ -227,7 +316,7 @@ register_handler (uint8_t vec_no, int dpl, enum intr_level level,
 void
 intr_register_ext (uint8_t vec_no, intr_handler_func *handler,
 		const char *name) {
-	ASSERT (vec_no >= 0x20 && vec_no <= 0x2f);
+	ASSERT (vec_no >= 0x20 && vec_no <= LAPIC_TIMER_VEC);
 	register_handler (vec_no, 0, INTR_OFF, handler, name);
 }
 
@@ -248,7 +337,7 @@ void
 intr_register_int (uint8_t vec_no, int dpl, enum intr_level level,
 		intr_handler_func *handler, const char *name)
 {
-	ASSERT (vec_no < 0x20 || vec_no > 0x2f);
+	ASSERT (vec_no < 0x20 || vec_no > LAPIC_TIMER_VEC);
 	register_handler (vec_no, dpl, level, handler, name);
 }
 
@@ -335,19 +424,22 @@ intr_handler (struct intr_frame *frame) {
 
 	/* External interrupts are special.
 	   We only handle one at a time (so interrupts must be off)
-	   and they need to be acknowledged on the PIC (see below).
+	   and they need to be acknowledged on the PIC, or on the
+	   local APIC for its timer (see below).
 	   An external interrupt handler cannot sleep. */
-	external = frame->vec_no >= 0x20 && frame->vec_no < 0x30;
+	external = frame->vec_no >= 0x20 && frame->vec_no <= LAPIC_TIMER_VEC;
+	handler = intr_handlers[frame->vec_no];
 	if (external) {
 		ASSERT (intr_get_level () == INTR_OFF);
 		ASSERT (!intr_context ());
 
 		in_external_intr = true;
 		yield_on_return = false;
+		if (intr_off_trace && (frame->eflags & FLAG_IF))
+			off_begin ((void *) handler);
 	}
 
 	/* Invoke the interrupt's handler. */
-	handler = intr_handlers[frame->vec_no];
 	if (handler != NULL)
 		handler (frame);
 	else if (frame->vec_no == 0x27 || frame->vec_no == 0x2f) {
@@ -367,11 +459,35 @@ intr_handler (struct intr_frame *frame) {
 		ASSERT (intr_context ());
 
 		in_external_intr = false;
-		pic_end_of_interrupt (frame->vec_no);
+		if (frame->vec_no == LAPIC_TIMER_VEC)
+			lapic_eoi ();
+		else
+			pic_end_of_interrupt (frame->vec_no);
+
+		/* The handler's window ends before the switch, which
+		   opens a window of its own that ends wherever the next
+		   thread turns interrupts back on. */
+		if (yield_on_return) {
+			if (intr_off_trace && (frame->eflags & FLAG_IF)) {
+				off_end ((void *) handler);
+				off_begin ((void *) thread_preempt);
+			}
+			thread_preempt ();
+		}
+
+		/* Returning re-enables interrupts. */
+		if (intr_off_trace && (frame->eflags & FLAG_IF))
+			off_end ((void *) handler);
+	}
 
-		if (yield_on_return)
-			thread_yield ();
+#ifdef USERPROG
+	/* A thread killed by another thread of its process dies
+	   instead of returning to user mode. */
+	if (frame->cs == SEL_UCSEG && thread_current ()->killed) {
+		intr_enable ();
+		thread_exit ();
 	}
+#endif
 }
 
 /* Dumps interrupt frame F to the console, for debugging. */
@@ -11,9 +11,11 @@
 
 /* A simple implementation of malloc().
 
-   The size of each request, in bytes, is rounded up to a power
-   of 2 and assigned to the "descriptor" that manages blocks of
-   that size.  The descriptor keeps a list of free blocks.  If
+   The size of each request, in bytes, is rounded up to a size
+   class and assigned to the "descriptor" that manages blocks of
+   that size.  Size classes are multiples of 16 bytes, each about
+   25% larger than the one before, up to the largest size that
+   still fits twice in an arena.  The descriptor keeps a list of free blocks.  If
    the free list is nonempty, one of its blocks is used to
    satisfy the request.
 
@@ -32,14 +34,27 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.
+
+   realloc() keeps a block in place whenever it can: a block
+   whose size class still fits the new size is returned as is,
+   and a big block's run of pages is shrunk, or grown into the
+   free pages that follow it, without copying.
+
+   Building with MALLOC_DEBUG defined (make MALLOC_DEBUG=1) puts
+   a hidden tag in front of every block that records its size and
+   the address of the call that allocated it, and keeps all live
+   blocks on a list.  malloc_print_stats() then lists the call
+   sites that own the blocks still live at shutdown. */
 
 /* Descriptor. */
 struct desc {
 	size_t block_size;          /* Size of each element in bytes. */
 	size_t blocks_per_arena;    /* Number of blocks in an arena. */
 	struct list free_list;      /* List of free blocks. */
-	struct lock lock;           /* Lock. */
+	struct mutex lock;          /* Lock. */
+	char name[16];              /* Lock name, e.g. "malloc 16". */
+	size_t arena_cnt;           /* Number of arenas. */
 };
 
 /* Magic number for detecting arena corruption. */
@@ -57,46 +72,206 @@ struct block {
 	struct list_elem free_elem; /* Free list element. */
 };
 
+#ifdef MALLOC_DEBUG
+/* Tag in front of every block in debug builds. */
+struct tag {
+	struct list_elem elem;      /* Element in live_tags. */
+	void *caller;               /* Where the block was allocated. */
+	size_t size;                /* Requested size in bytes. */
+};
+#define TAG_SIZE sizeof (struct tag)
+
+static struct list live_tags;   /* Tags of all live blocks. */
+static struct mutex tags_lock;  /* Protects live_tags. */
+
+static void *tag_block (void *, size_t size, void *caller);
+static void *untag_block (void *);
+static void retag_block (void *, size_t size);
+static void print_call_sites (void);
+#else
+#define TAG_SIZE 0
+#define tag_block(BLOCK, SIZE, CALLER) (BLOCK)
+#define untag_block(BLOCK) (BLOCK)
+#define retag_block(BLOCK, SIZE) ((void) 0)
+#endif
+
+/* Big blocks, updated atomically. */
+static size_t big_cnt;          /* Number of big blocks. */
+static size_t big_pages;        /* Pages in big blocks. */
+
+/* Largest size class: two blocks per arena. */
+#define MAX_CLASS_SIZE ((PGSIZE - sizeof (struct arena)) / 2 / 16 * 16)
+
 /* Our set of descriptors. */
-static struct desc descs[10];   /* Descriptors. */
+static struct desc descs[32];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+/* Maps (SIZE + 15) / 16 to the smallest descriptor whose blocks
+   hold SIZE bytes. */
+static uint8_t desc_index[MAX_CLASS_SIZE / 16 + 1];
+
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static struct desc *size_to_desc (size_t size);
+static bool realloc_in_place (void *block, size_t new_size);
+static size_t block_size (void *block);
+static void *block_alloc (size_t size);
+static void block_free (void *);
+static void *malloc_from (size_t size, void *caller);
 
 /* Initializes the malloc() descriptors. */
 void
 malloc_init (void) {
-	size_t block_size;
+	size_t block_size, i;
 
-	for (block_size = 16; block_size < PGSIZE / 2; block_size *= 2) {
+	for (block_size = 16; ; block_size = ROUND_UP (block_size * 5 / 4, 16)) {
 		struct desc *d = &descs[desc_cnt++];
 		ASSERT (desc_cnt <= sizeof descs / sizeof *descs);
+		if (block_size > MAX_CLASS_SIZE)
+			block_size = MAX_CLASS_SIZE;
 		d->block_size = block_size;
 		d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
 		list_init (&d->free_list);
-		lock_init (&d->lock);
+		snprintf (d->name, sizeof d->name, "malloc %zu", block_size);
+		mutex_init_named (&d->lock, d->name);
+		if (block_size == MAX_CLASS_SIZE)
+			break;
 	}
+
+	for (i = 0, block_size = 0; block_size <= MAX_CLASS_SIZE; block_size += 16) {
+		while (descs[i].block_size < block_size)
+			i++;
+		desc_index[block_size / 16] = i;
+	}
+
+#ifdef MALLOC_DEBUG
+	list_init (&live_tags);
+	mutex_init (&tags_lock);
+#endif
 }
 
 /* Obtains and returns a new block of at least SIZE bytes.
    Returns a null pointer if memory is not available. */
 void *
 malloc (size_t size) {
-	struct desc *d;
-	struct block *b;
-	struct arena *a;
+	return malloc_from (size, __builtin_return_address (0));
+}
+
+/* Allocates and return A times B bytes initialized to zeroes.
+   Returns a null pointer if memory is not available. */
+void *
+calloc (size_t a, size_t b) {
+	void *p;
+	size_t size;
+
+	/* Calculate block size and make sure it fits in size_t. */
+	size = a * b;
+	if (size < a || size < b)
+		return NULL;
+
+	/* Allocate and zero memory. */
+	p = malloc_from (size, __builtin_return_address (0));
+	if (p != NULL)
+		memset (p, 0, size);
+
+	return p;
+}
+
+/* Attempts to resize OLD_BLOCK to NEW_SIZE bytes, possibly
+   moving it in the process.
+   If successful, returns the new block; on failure, returns a
+   null pointer.
+   A call with null OLD_BLOCK is equivalent to malloc(NEW_SIZE).
+   A call with zero NEW_SIZE is equivalent to free(OLD_BLOCK). */
+void *
+realloc (void *old_block, size_t new_size) {
+	if (new_size == 0) {
+		free (old_block);
+		return NULL;
+	} else {
+		void *new_block;
+
+		if (old_block != NULL
+				&& realloc_in_place ((uint8_t *) old_block - TAG_SIZE,
+					new_size + TAG_SIZE)) {
+			retag_block (old_block, new_size);
+			return old_block;
+		}
+
+		new_block = malloc_from (new_size, __builtin_return_address (0));
+		if (old_block != NULL && new_block != NULL) {
+			size_t old_size = block_size ((uint8_t *) old_block - TAG_SIZE)
+				- TAG_SIZE;
+			size_t min_size = new_size < old_size ? new_size : old_size;
+			memcpy (new_block, old_block, min_size);
+			free (old_block);
+		}
+		return new_block;
+	}
+}
+
+/* Frees block P, which must have been previously allocated with
+   malloc(), calloc(), or realloc(). */
+void
+free (void *p) {
+	if (p != NULL)
+		block_free (untag_block (p));
+}
+
+/* Prints per-size-class statistics, and in debug builds the call
+   sites of the blocks still live. */
+void
+malloc_print_stats (void) {
+	printf ("Malloc: %zu big blocks in %zu pages\n", big_cnt, big_pages);
+	for (size_t i = 0; i < desc_cnt; i++) {
+		struct desc *d = &descs[i];
+		size_t free_cnt, arena_cnt;
+
+		mutex_lock (&d->lock);
+		arena_cnt = d->arena_cnt;
+		free_cnt = list_size (&d->free_list);
+		mutex_unlock (&d->lock);
+		if (arena_cnt > 0)
+			printf ("  %4zu bytes: %zu live, %zu free, %zu arenas\n",
+					d->block_size, arena_cnt * d->blocks_per_arena - free_cnt,
+					free_cnt, arena_cnt);
+	}
+#ifdef MALLOC_DEBUG
+	print_call_sites ();
+#endif
+}
 
+/* Allocates a SIZE-byte block on behalf of CALLER. */
+static void *
+malloc_from (size_t size, void *caller UNUSED) {
 	/* A null pointer satisfies a request for 0 bytes. */
 	if (size == 0)
 		return NULL;
+	return tag_block (block_alloc (size + TAG_SIZE), size, caller);
+}
+
+/* Returns the descriptor for SIZE-byte blocks, or a null pointer
+   if SIZE calls for a big block. */
+static struct desc *
+size_to_desc (size_t size) {
+	if (size > MAX_CLASS_SIZE)
+		return NULL;
+	return &descs[desc_index[DIV_ROUND_UP (size, 16)]];
+}
+
+/* Obtains and returns a new block of at least SIZE bytes, not
+   counting any tag.  Returns a null pointer if memory is not
+   available. */
+static void *
+block_alloc (size_t size) {
+	struct desc *d;
+	struct block *b;
+	struct arena *a;
 
 	/* Find the smallest descriptor that satisfies a SIZE-byte
 	   request. */
-	for (d = descs; d < descs + desc_cnt; d++)
-		if (d->block_size >= size)
-			break;
-	if (d == descs + desc_cnt) {
+	d = size_to_desc (size);
+	if (d == NULL) {
 		/* SIZE is too big for any descriptor.
 		   Allocate enough pages to hold SIZE plus an arena. */
 		size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PGSIZE);
@@ -109,10 +284,12 @@ malloc (size_t size) {
 		a->magic = ARENA_MAGIC;
 		a->desc = NULL;
 		a->free_cnt = page_cnt;
+		__atomic_add_fetch (&big_cnt, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch (&big_pages, page_cnt, __ATOMIC_RELAXED);
 		return a + 1;
 	}
 
-	lock_acquire (&d->lock);
+	mutex_lock (&d->lock);
 
 	/* If the free list is empty, create a new arena. */
 	if (list_empty (&d->free_list)) {
@@ -121,7 +298,7 @@ malloc (size_t size) {
 		/* Allocate a page. */
 		a = palloc_get_page (0);
 		if (a == NULL) {
-			lock_release (&d->lock);
+			mutex_unlock (&d->lock);
 			return NULL;
 		}
 
@@ -129,6 +306,7 @@ malloc (size_t size) {
 		a->magic = ARENA_MAGIC;
 		a->desc = d;
 		a->free_cnt = d->blocks_per_arena;
+		d->arena_cnt++;
 		for (i = 0; i < d->blocks_per_arena; i++) {
 			struct block *b = arena_to_block (a, i);
 			list_push_back (&d->free_list, &b->free_elem);
@@ -139,30 +317,10 @@ malloc (size_t size) {
 	b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
 	a = block_to_arena (b);
 	a->free_cnt--;
-	lock_release (&d->lock);
+	mutex_unlock (&d->lock);
 	return b;
 }
 
-/* Allocates and return A times B bytes initialized to zeroes.
-   Returns a null pointer if memory is not available. */
-void *
-calloc (size_t a, size_t b) {
-	void *p;
-	size_t size;
-
-	/* Calculate block size and make sure it fits in size_t. */
-	size = a * b;
-	if (size < a || size < b)
-		return NULL;
-
-	/* Allocate and zero memory. */
-	p = malloc (size);
-	if (p != NULL)
-		memset (p, 0, size);
-
-	return p;
-}
-
 /* Returns the number of bytes allocated for BLOCK. */
 static size_t
 block_size (void *block) {
@@ -173,33 +331,38 @@ block_size (void *block) {
 	return d != NULL ? d->block_size : PGSIZE * a->free_cnt - pg_ofs (block);
 }
 
-/* Attempts to resize OLD_BLOCK to NEW_SIZE bytes, possibly
-   moving it in the process.
-   If successful, returns the new block; on failure, returns a
-   null pointer.
-   A call with null OLD_BLOCK is equivalent to malloc(NEW_SIZE).
-   A call with zero NEW_SIZE is equivalent to free(OLD_BLOCK). */
-void *
-realloc (void *old_block, size_t new_size) {
-	if (new_size == 0) {
-		free (old_block);
-		return NULL;
-	} else {
-		void *new_block = malloc (new_size);
-		if (old_block != NULL && new_block != NULL) {
-			size_t old_size = block_size (old_block);
-			size_t min_size = new_size < old_size ? new_size : old_size;
-			memcpy (new_block, old_block, min_size);
-			free (old_block);
-		}
-		return new_block;
-	}
+/* Tries to make BLOCK hold NEW_SIZE bytes without moving it.
+   Returns true if successful. */
+static bool
+realloc_in_place (void *block, size_t new_size) {
+	struct arena *a = block_to_arena (block);
+	size_t page_cnt;
+
+	/* A normal block stays while its size class fits. */
+	if (a->desc != NULL)
+		return new_size <= a->desc->block_size;
+
+	/* A big block that has become small enough for a size class
+	   moves there. */
+	if (size_to_desc (new_size) != NULL)
+		return false;
+
+	/* Shrink or grow the big block's run of pages. */
+	page_cnt = DIV_ROUND_UP (new_size + sizeof *a, PGSIZE);
+	if (page_cnt < a->free_cnt)
+		palloc_free_multiple ((uint8_t *) a + page_cnt * PGSIZE,
+				a->free_cnt - page_cnt);
+	else if (page_cnt > a->free_cnt
+			&& !palloc_extend (a, a->free_cnt, page_cnt))
+		return false;
+	__atomic_add_fetch (&big_pages, page_cnt - a->free_cnt, __ATOMIC_RELAXED);
+	a->free_cnt = page_cnt;
+	return true;
 }
 
-/* Frees block P, which must have been previously allocated with
-   malloc(), calloc(), or realloc(). */
-void
-free (void *p) {
+/* Frees block P, which must have come from block_alloc(). */
+static void
+block_free (void *p) {
 	if (p != NULL) {
 		struct block *b = p;
 		struct arena *a = block_to_arena (b);
@@ -213,7 +376,7 @@ free (void *p) {
 			memset (b, 0xcc, d->block_size);
 #endif
 
-			lock_acquire (&d->lock);
+			mutex_lock (&d->lock);
 
 			/* Add block to free list. */
 			list_push_front (&d->free_list, &b->free_elem);
@@ -228,11 +391,14 @@ free (void *p) {
 					list_remove (&b->free_elem);
 				}
 				palloc_free_page (a);
+				d->arena_cnt--;
 			}
 
-			lock_release (&d->lock);
+			mutex_unlock (&d->lock);
 		} else {
 			/* It's a big block.  Free its pages. */
+			__atomic_sub_fetch (&big_cnt, 1, __ATOMIC_RELAXED);
+			__atomic_sub_fetch (&big_pages, a->free_cnt, __ATOMIC_RELAXED);
 			palloc_free_multiple (a, a->free_cnt);
 			return;
 		}
@@ -266,3 +432,88 @@ arena_to_block (struct arena *a, size_t idx) {
 			+ sizeof *a
 			+ idx * a->desc->block_size);
 }
+
+#ifdef MALLOC_DEBUG
+/* Fills in the tag at the start of BLOCK, if not null, and
+   returns the memory after it. */
+static void *
+tag_block (void *block, size_t size, void *caller) {
+	struct tag *t = block;
+
+	if (t == NULL)
+		return NULL;
+	t->caller = caller;
+	t->size = size;
+	mutex_lock (&tags_lock);
+	list_push_back (&live_tags, &t->elem);
+	mutex_unlock (&tags_lock);
+	return t + 1;
+}
+
+/* Drops the tag in front of P and returns the underlying block. */
+static void *
+untag_block (void *p) {
+	struct tag *t = (struct tag *) p - 1;
+
+	mutex_lock (&tags_lock);
+	list_remove (&t->elem);
+	mutex_unlock (&tags_lock);
+	return t;
+}
+
+/* Records that P, resized in place, now holds SIZE bytes. */
+static void
+retag_block (void *p, size_t size) {
+	struct tag *t = (struct tag *) p - 1;
+	t->size = size;
+}
+
+/* Prints the call sites owning the most live bytes.  Feed the
+   addresses to the backtrace tool to get function names. */
+static void
+print_call_sites (void) {
+	enum { SITE_CNT = 32, PRINT_CNT = 10 };
+	struct site {
+		void *caller;
+		size_t cnt;
+		size_t bytes;
+	} sites[SITE_CNT];
+	size_t site_cnt = 0, other = 0;
+	struct list_elem *e;
+
+	mutex_lock (&tags_lock);
+	for (e = list_begin (&live_tags); e != list_end (&live_tags);
+			e = list_next (e)) {
+		struct tag *t = list_entry (e, struct tag, elem);
+		size_t i;
+
+		for (i = 0; i < site_cnt; i++)
+			if (sites[i].caller == t->caller)
+				break;
+		if (i == site_cnt) {
+			if (site_cnt == SITE_CNT) {
+				other++;
+				continue;
+			}
+			sites[site_cnt++] = (struct site) { t->caller, 0, 0 };
+		}
+		sites[i].cnt++;
+		sites[i].bytes += t->size;
+	}
+	mutex_unlock (&tags_lock);
+
+	printf ("Live malloc blocks by call site:\n");
+	for (int n = 0; n < PRINT_CNT && site_cnt > 0; n++) {
+		size_t max = 0;
+
+		for (size_t i = 1; i < site_cnt; i++)
+			if (sites[i].bytes > sites[max].bytes)
+				max = i;
+		printf ("  %p: %zu blocks, %zu bytes\n",
+				sites[max].caller, sites[max].cnt, sites[max].bytes);
+		sites[max] = sites[--site_cnt];
+	}
+	if (other > 0)
+		printf ("  (%zu blocks from other call sites)\n", other);
+}
+#endif /* MALLOC_DEBUG */
@@ -2,14 +2,17 @@
 #include <bitmap.h>
 #include <debug.h>
 #include <inttypes.h>
+#include <list.h>
 #include <round.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 #include "threads/vaddr.h"
 
 /* Page allocator.  Hands out memory in page-size (or
@@ -24,13 +27,73 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Each pool is a binary buddy allocator.  Its free memory is kept
+   as blocks of 2**ORDER pages, aligned to their size relative to
+   the pool's base, on one free list per order.  A request for N
+   pages takes a block of the smallest order that fits, splitting
+   larger blocks as needed, and gives back the tail beyond N.
+   Freed blocks are merged with their free buddies.  The free
+   list links live in the free pages themselves.
+
+   In front of each pool sits a magazine of single pages, so that
+   most single-page allocations and frees touch neither the pool
+   lock nor the free lists.  The magazine is refilled from, or
+   flushed to, the pool PAGE_MAG_BATCH pages at a time.
+
+   A pool's used_map has a bit set for each page that is off its
+   free lists: in use, or cached in a magazine or the zero pool.
+   It is only changed with the pool lock held, and catches double
+   frees.
+
+   Finally, a kernel thread at the lowest priority keeps a stack
+   of pre-zeroed pages for each pool, so that PAL_ZERO requests
+   for a single page need not clear it on the page fault or spawn
+   path.  Waiting zeroed pages count as in use.  The stack holds
+   pointers rather than list links, so that the pages stay
+   zero. */
+
+/* Number of block orders: blocks range from 1 page to
+   2**(PALLOC_ORDERS - 1) pages. */
+#define PALLOC_ORDERS 20
+
+/* free_order value of a page that does not begin a free block. */
+#define NOT_FREE 0xff
+
+/* Cache of single pages in front of a pool. */
+#define PAGE_MAG_SIZE 32                /* Capacity. */
+#define PAGE_MAG_BATCH 16               /* Pages moved per refill or flush. */
+
+struct page_magazine {
+	size_t cnt;                     /* Number of pages cached. */
+	void *pages[PAGE_MAG_SIZE];
+};
+
+/* Pre-zeroed pages. */
+#define ZERO_POOL_SIZE 64               /* Capacity. */
+#define ZERO_POOL_LOW 32                /* Refill when fewer remain. */
+
+struct zero_pool {
+	size_t cnt;                     /* Number of pages. */
+	void *pages[ZERO_POOL_SIZE];
+};
 
 /* A memory pool. */
 struct pool {
-	struct lock lock;               /* Mutual exclusion. */
-	struct bitmap *used_map;        /* Bitmap of free pages. */
+	struct mutex lock;              /* Protects the free lists. */
+	struct bitmap *used_map;        /* Pages off the free lists. */
 	uint8_t *base;                  /* Base of pool. */
+	size_t page_cnt;                /* Number of pages in pool. */
+	uint8_t *free_order;            /* Order of the free block at each page. */
+	struct list free_lists[PALLOC_ORDERS];
+	struct page_magazine mag;       /* Only touched with interrupts off. */
+	struct zero_pool zero;          /* Only touched with interrupts off. */
+
+	/* Statistics. */
+	size_t usable_cnt;              /* Pages given to the free lists at boot. */
+	size_t used_cnt;                /* Pages handed out, updated atomically. */
+	size_t used_max;                /* High-water mark of used_cnt. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -38,10 +101,36 @@ static struct pool kernel_pool, user_pool;
 
 /* Maximum number of pages to put in user pool. */
 size_t user_page_limit = SIZE_MAX;
+
+/* Page zeroing thread. */
+static struct semaphore zero_sema;      /* Upped to request a refill. */
+static bool zero_started;               /* Thread running? */
+static bool zero_wanted;                /* Refill already requested? */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end);
 
 static bool page_from_pool (const struct pool *, void *page);
+static void init_free_lists (struct pool *);
+static size_t buddy_alloc (struct pool *, int order);
+static void buddy_free (struct pool *, size_t page_idx, int order);
+static void free_range (struct pool *, size_t page_idx, size_t page_cnt);
+static bool find_free_block (struct pool *, size_t page_idx,
+		size_t *head, int *order);
+static bool pool_claim (struct pool *, size_t page_idx, size_t page_cnt);
+static size_t find_free_run (struct pool *, size_t page_cnt);
+static void mark_used (struct pool *, size_t page_idx, size_t page_cnt);
+static void mark_free (struct pool *, size_t page_idx, size_t page_cnt);
+static void *pool_get (struct pool *, size_t page_cnt);
+static void pool_put_pages (struct pool *, void **pages, size_t cnt);
+static void *mag_get (struct pool *);
+static void mag_put (struct pool *, void *page);
+static void mag_drain (struct pool *);
+static void *zero_get (struct pool *);
+static void zero_drain (struct pool *);
+static void zero_fill (struct pool *);
+static void count_used (struct pool *, size_t page_cnt);
+static void pool_print_stats (const char *name, struct pool *);
+static void zero_thread (void *aux UNUSED);
 
 /* multiboot info */
 struct multiboot_info {
@@ -232,6 +321,9 @@ split:
 			}
 		}
 	}
+
+	init_free_lists (&kernel_pool);
+	init_free_lists (&user_pool);
 }
 
 /* Initializes the page allocator and get the memory size */
@@ -262,18 +354,35 @@ palloc_init (void) {
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	void *pages = NULL;
+
+	/* Pre-zeroed pages are already off the free lists; zero_get()
+	   counts them as used. */
+	if (page_cnt == 1 && (flags & PAL_ZERO)) {
+		pages = zero_get (pool);
+		if (pages != NULL)
+			return pages;
+	}
 
-	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-	lock_release (&pool->lock);
-	void *pages;
-
-	if (page_idx != BITMAP_ERROR)
-		pages = pool->base + PGSIZE * page_idx;
-	else
-		pages = NULL;
+	if (page_cnt == 1)
+		pages = mag_get (pool);
+	else if (page_cnt > 1)
+		pages = pool_get (pool, page_cnt);
+
+	/* Under memory pressure, give back the pages that the thread
+	   system, the zeroing thread and the magazine keep for
+	   reuse and try again.  The thread system frees its pages
+	   into the magazine, so the magazine goes last. */
+	if (pages == NULL && page_cnt > 0) {
+		if (pool == &kernel_pool)
+			thread_cache_shrink ();
+		zero_drain (pool);
+		mag_drain (pool);
+		pages = pool_get (pool, page_cnt);
+	}
 
 	if (pages) {
+		count_used (pool, page_cnt);
 		if (flags & PAL_ZERO)
 			memset (pages, 0, PGSIZE * page_cnt);
 	} else {
@@ -318,8 +427,17 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 #ifndef NDEBUG
 	memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
-	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	__atomic_sub_fetch (&pool->used_cnt, page_cnt, __ATOMIC_RELAXED);
+
+	if (page_cnt == 1) {
+		ASSERT (bitmap_test (pool->used_map, page_idx));
+		mag_put (pool, pages);
+	} else {
+		mutex_lock (&pool->lock);
+		mark_free (pool, page_idx, page_cnt);
+		free_range (pool, page_idx, page_cnt);
+		mutex_unlock (&pool->lock);
+	}
 }
 
 /* Frees the page at PAGE. */
@@ -328,6 +446,61 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Tries to grow the PAGE_CNT pages starting at PAGES, obtained
+   from palloc_get_multiple(), to NEW_CNT pages in place, by
+   taking the free pages that follow them.  Returns true if
+   successful, false if any of those pages is in use or beyond
+   the end of the pool. */
+bool
+palloc_extend (void *pages, size_t page_cnt, size_t new_cnt) {
+	struct pool *pool;
+	size_t start;
+	bool success;
+
+	ASSERT (pg_ofs (pages) == 0);
+	ASSERT (new_cnt >= page_cnt);
+
+	if (page_from_pool (&kernel_pool, pages))
+		pool = &kernel_pool;
+	else if (page_from_pool (&user_pool, pages))
+		pool = &user_pool;
+	else
+		NOT_REACHED ();
+
+	start = pg_no (pages) - pg_no (pool->base) + page_cnt;
+	if (new_cnt == page_cnt)
+		return true;
+	if (start + (new_cnt - page_cnt) > pool->page_cnt)
+		return false;
+
+	mutex_lock (&pool->lock);
+	success = pool_claim (pool, start, new_cnt - page_cnt);
+	if (success)
+		mark_used (pool, start, new_cnt - page_cnt);
+	mutex_unlock (&pool->lock);
+
+	if (success)
+		count_used (pool, new_cnt - page_cnt);
+	return success;
+}
+
+/* Prints page allocator statistics. */
+void
+palloc_print_stats (void) {
+	pool_print_stats ("kernel", &kernel_pool);
+	pool_print_stats ("user", &user_pool);
+}
+
+/* Starts the thread that keeps pre-zeroed pages ready.  Until it
+   runs, PAL_ZERO pages are cleared on allocation. */
+void
+palloc_zero_start (void) {
+	sema_init (&zero_sema, 1);
+	zero_started = true;
+	if (thread_create ("pagezero", PRI_MIN, zero_thread, NULL) == TID_ERROR)
+		zero_started = false;
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
@@ -335,11 +508,17 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
      Calculate the space needed for the bitmap
      and subtract it from the pool's size. */
 	uint64_t pgcnt = (end - start) / PGSIZE;
-	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
+	size_t bm_size = bitmap_buf_size (pgcnt);
+	size_t bm_pages = DIV_ROUND_UP (bm_size + pgcnt, PGSIZE) * PGSIZE;
 
-	lock_init(&p->lock);
-	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
+	mutex_init (&p->lock);
+	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_size);
 	p->base = (void *) start;
+	p->page_cnt = pgcnt;
+	p->free_order = (uint8_t *) *bm_base + bm_size;
+	memset (p->free_order, NOT_FREE, pgcnt);
+	for (int order = 0; order < PALLOC_ORDERS; order++)
+		list_init (&p->free_lists[order]);
 
 	// Mark all to unusable.
 	bitmap_set_all(p->used_map, true);
@@ -347,12 +526,476 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
 	*bm_base += bm_pages;
 }
 
+/* Puts every page of P that populate_pools() marked usable on
+   P's free lists. */
+static void
+init_free_lists (struct pool *p) {
+	size_t start = 0;
+
+	while (start < p->page_cnt) {
+		size_t end;
+
+		start = bitmap_scan (p->used_map, start, 1, false);
+		if (start == BITMAP_ERROR)
+			break;
+		end = bitmap_scan (p->used_map, start, 1, true);
+		if (end == BITMAP_ERROR)
+			end = p->page_cnt;
+		free_range (p, start, end - start);
+		p->usable_cnt += end - start;
+		start = end;
+	}
+}
+
+/* Returns the free list element stored in page PAGE_IDX of P. */
+static struct list_elem *
+page_elem (struct pool *p, size_t page_idx) {
+	return (struct list_elem *) (p->base + page_idx * PGSIZE);
+}
+
+/* Removes a free block of 2**ORDER pages from P and returns the
+   index of its first page, or BITMAP_ERROR if there is none.
+   P's lock must be held. */
+static size_t
+buddy_alloc (struct pool *p, int order) {
+	int k;
+	size_t page_idx;
+
+	for (k = order; k < PALLOC_ORDERS; k++)
+		if (!list_empty (&p->free_lists[k]))
+			break;
+	if (k == PALLOC_ORDERS)
+		return BITMAP_ERROR;
+
+	page_idx = ((uint8_t *) list_pop_front (&p->free_lists[k])
+			- p->base) / PGSIZE;
+	p->free_order[page_idx] = NOT_FREE;
+
+	/* Split off the upper halves until the block is small enough. */
+	while (k > order) {
+		size_t buddy;
+
+		k--;
+		buddy = page_idx + ((size_t) 1 << k);
+		p->free_order[buddy] = k;
+		list_push_front (&p->free_lists[k], page_elem (p, buddy));
+	}
+	return page_idx;
+}
+
+/* Returns the free block of 2**ORDER pages at PAGE_IDX to P,
+   merging it with its buddy as long as that is free.  P's lock
+   must be held. */
+static void
+buddy_free (struct pool *p, size_t page_idx, int order) {
+	ASSERT (page_idx % ((size_t) 1 << order) == 0);
+
+	while (order < PALLOC_ORDERS - 1) {
+		size_t buddy = page_idx ^ ((size_t) 1 << order);
+
+		if (buddy >= p->page_cnt || p->free_order[buddy] != order)
+			break;
+		list_remove (page_elem (p, buddy));
+		p->free_order[buddy] = NOT_FREE;
+		page_idx &= ~((size_t) 1 << order);
+		order++;
+	}
+	p->free_order[page_idx] = order;
+	list_push_front (&p->free_lists[order], page_elem (p, page_idx));
+}
+
+/* Returns the PAGE_CNT pages starting at PAGE_IDX to P, as the
+   largest aligned blocks that cover them.  P's lock must be
+   held. */
+static void
+free_range (struct pool *p, size_t page_idx, size_t page_cnt) {
+	while (page_cnt > 0) {
+		int order = 0;
+
+		while (order < PALLOC_ORDERS - 1
+				&& page_idx % ((size_t) 2 << order) == 0
+				&& ((size_t) 2 << order) <= page_cnt)
+			order++;
+		buddy_free (p, page_idx, order);
+		page_idx += (size_t) 1 << order;
+		page_cnt -= (size_t) 1 << order;
+	}
+}
+
+/* Finds the free block of P that contains page PAGE_IDX and
+   stores its first page and order in *HEAD and *ORDER.  Returns
+   false if the page is not free.  P's lock must be held. */
+static bool
+find_free_block (struct pool *p, size_t page_idx, size_t *head, int *order) {
+	for (int k = 0; k < PALLOC_ORDERS; k++) {
+		size_t h = page_idx & ~(((size_t) 1 << k) - 1);
+		if (p->free_order[h] == k) {
+			*head = h;
+			*order = k;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Takes the PAGE_CNT pages starting at PAGE_IDX off P's free
+   lists, if they are all free, splitting the blocks that hold
+   them.  Returns true if successful.  P's lock must be held. */
+static bool
+pool_claim (struct pool *p, size_t page_idx, size_t page_cnt) {
+	size_t end = page_idx + page_cnt;
+	size_t head, i;
+	int order;
+
+	for (i = page_idx; i < end; i = head + ((size_t) 1 << order))
+		if (!find_free_block (p, i, &head, &order))
+			return false;
+
+	for (i = page_idx; i < end; ) {
+		size_t block_end;
+
+		find_free_block (p, i, &head, &order);
+		block_end = head + ((size_t) 1 << order);
+		list_remove (page_elem (p, head));
+		p->free_order[head] = NOT_FREE;
+
+		/* Give back the parts of the block outside the range. */
+		if (head < page_idx)
+			free_range (p, head, page_idx - head);
+		if (block_end > end)
+			free_range (p, end, block_end - end);
+		i = block_end;
+	}
+	return true;
+}
+
+/* Returns the first page of the lowest run of at least PAGE_CNT
+   free pages in P, made of adjacent free blocks, or BITMAP_ERROR
+   if there is none.  P's lock must be held. */
+static size_t
+find_free_run (struct pool *p, size_t page_cnt) {
+	size_t start = 0, run = 0;
+
+	for (size_t i = 0; i < p->page_cnt; ) {
+		if (p->free_order[i] == NOT_FREE) {
+			run = 0;
+			i++;
+			continue;
+		}
+		if (run == 0)
+			start = i;
+		run += (size_t) 1 << p->free_order[i];
+		if (run >= page_cnt)
+			return start;
+		i += (size_t) 1 << p->free_order[i];
+	}
+	return BITMAP_ERROR;
+}
+
+/* Records in P's used_map that the PAGE_CNT pages starting at
+   PAGE_IDX left the free lists.  P's lock must be held. */
+static void
+mark_used (struct pool *p, size_t page_idx, size_t page_cnt) {
+	ASSERT (bitmap_none (p->used_map, page_idx, page_cnt));
+	bitmap_set_multiple (p->used_map, page_idx, page_cnt, true);
+}
+
+/* Records in P's used_map that the PAGE_CNT pages starting at
+   PAGE_IDX go back to the free lists.  Panics on a double free.
+   P's lock must be held. */
+static void
+mark_free (struct pool *p, size_t page_idx, size_t page_cnt) {
+	ASSERT (bitmap_all (p->used_map, page_idx, page_cnt));
+	bitmap_set_multiple (p->used_map, page_idx, page_cnt, false);
+}
+
+/* Takes PAGE_CNT contiguous pages from P's free lists.  Returns
+   a null pointer if there is no free run that large.
+
+   The smallest aligned block that holds PAGE_CNT pages is tried
+   first.  A request that is not a power of two may still fit in
+   a run of smaller adjacent blocks, so failing that the free
+   blocks are scanned in address order. */
+static void *
+pool_get (struct pool *p, size_t page_cnt) {
+	size_t page_idx = BITMAP_ERROR;
+	int order = 0;
+
+	while (order < PALLOC_ORDERS - 1 && ((size_t) 1 << order) < page_cnt)
+		order++;
+
+	mutex_lock (&p->lock);
+	if (((size_t) 1 << order) >= page_cnt)
+		page_idx = buddy_alloc (p, order);
+	if (page_idx != BITMAP_ERROR)
+		free_range (p, page_idx + page_cnt,
+				((size_t) 1 << order) - page_cnt);
+	else {
+		page_idx = find_free_run (p, page_cnt);
+		if (page_idx != BITMAP_ERROR && !pool_claim (p, page_idx, page_cnt))
+			NOT_REACHED ();
+	}
+	if (page_idx != BITMAP_ERROR)
+		mark_used (p, page_idx, page_cnt);
+	mutex_unlock (&p->lock);
+
+	return page_idx != BITMAP_ERROR ? p->base + page_idx * PGSIZE : NULL;
+}
+
+/* Returns the CNT single pages in PAGES to P's free lists. */
+static void
+pool_put_pages (struct pool *p, void **pages, size_t cnt) {
+	mutex_lock (&p->lock);
+	while (cnt > 0) {
+		size_t page_idx = pg_no (pages[--cnt]) - pg_no (p->base);
+
+		mark_free (p, page_idx, 1);
+		buddy_free (p, page_idx, 0);
+	}
+	mutex_unlock (&p->lock);
+}
+
+/* Takes a single page from P's magazine, refilling it from P's
+   free lists if it is empty.  Returns a null pointer if P has no
+   free page. */
+static void *
+mag_get (struct pool *p) {
+	struct page_magazine *m;
+	void *batch[PAGE_MAG_BATCH];
+	enum intr_level old_level;
+	void *page = NULL;
+	size_t cnt;
+
+	old_level = intr_disable ();
+	m = &p->mag;
+	if (m->cnt > 0)
+		page = m->pages[--m->cnt];
+	intr_set_level (old_level);
+	if (page != NULL)
+		return page;
+
+	mutex_lock (&p->lock);
+	for (cnt = 0; cnt < PAGE_MAG_BATCH; cnt++) {
+		size_t page_idx = buddy_alloc (p, 0);
+		if (page_idx == BITMAP_ERROR)
+			break;
+		mark_used (p, page_idx, 1);
+		batch[cnt] = p->base + page_idx * PGSIZE;
+	}
+	mutex_unlock (&p->lock);
+	if (cnt == 0)
+		return NULL;
+	page = batch[--cnt];
+
+	/* We may have been preempted while holding the lock, and the
+	   magazine refilled meanwhile.  Whatever does not fit goes
+	   back. */
+	old_level = intr_disable ();
+	m = &p->mag;
+	while (cnt > 0 && m->cnt < PAGE_MAG_SIZE)
+		m->pages[m->cnt++] = batch[--cnt];
+	intr_set_level (old_level);
+
+	if (cnt > 0)
+		pool_put_pages (p, batch, cnt);
+	return page;
+}
+
+/* Puts PAGE into P's magazine, first flushing part of the
+   magazine to P's free lists if it is full. */
+static void
+mag_put (struct pool *p, void *page) {
+	struct page_magazine *m;
+	void *batch[PAGE_MAG_BATCH];
+	enum intr_level old_level;
+	size_t cnt = 0;
+
+	old_level = intr_disable ();
+	m = &p->mag;
+#ifndef NDEBUG
+	/* A page in the magazine still counts as used in used_map, so
+	   catch double frees here. */
+	for (size_t i = 0; i < m->cnt; i++)
+		ASSERT (m->pages[i] != page);
+#endif
+	if (m->cnt == PAGE_MAG_SIZE) {
+		cnt = PAGE_MAG_BATCH;
+		m->cnt -= cnt;
+		memcpy (batch, &m->pages[m->cnt], cnt * sizeof *batch);
+	}
+	m->pages[m->cnt++] = page;
+	intr_set_level (old_level);
+
+	if (cnt > 0)
+		pool_put_pages (p, batch, cnt);
+}
+
+/* Returns every page in P's magazine to P's free lists, so that
+   they can merge into larger blocks. */
+static void
+mag_drain (struct pool *p) {
+	struct page_magazine *m;
+	void *batch[PAGE_MAG_SIZE];
+	enum intr_level old_level;
+	size_t cnt;
+
+	old_level = intr_disable ();
+	m = &p->mag;
+	cnt = m->cnt;
+	memcpy (batch, m->pages, cnt * sizeof *batch);
+	m->cnt = 0;
+	intr_set_level (old_level);
+
+	if (cnt > 0)
+		pool_put_pages (p, batch, cnt);
+}
+
 /* Returns true if PAGE was allocated from POOL,
    false otherwise. */
 static bool
 page_from_pool (const struct pool *pool, void *page) {
 	size_t page_no = pg_no (page);
 	size_t start_page = pg_no (pool->base);
-	size_t end_page = start_page + bitmap_size (pool->used_map);
+	size_t end_page = start_page + pool->page_cnt;
 	return page_no >= start_page && page_no < end_page;
 }
+
+/* Takes a zeroed page from P's zero pool, asking the zeroing
+   thread for more if it runs low.  Returns a null pointer if the
+   pool is empty. */
+static void *
+zero_get (struct pool *p) {
+	enum intr_level old_level;
+	void *page = NULL;
+	bool low;
+
+	old_level = intr_disable ();
+	if (p->zero.cnt > 0)
+		page = p->zero.pages[--p->zero.cnt];
+	low = p->zero.cnt < ZERO_POOL_LOW;
+	intr_set_level (old_level);
+
+	if (page != NULL)
+		count_used (p, 1);
+	if (low && zero_started
+			&& !__atomic_exchange_n (&zero_wanted, true, __ATOMIC_ACQ_REL))
+		sema_up (&zero_sema);
+	return page;
+}
+
+/* Returns every page in P's zero pool to P's free lists. */
+static void
+zero_drain (struct pool *p) {
+	void *batch[ZERO_POOL_SIZE];
+	enum intr_level old_level;
+	size_t cnt;
+
+	old_level = intr_disable ();
+	cnt = p->zero.cnt;
+	memcpy (batch, p->zero.pages, cnt * sizeof *batch);
+	p->zero.cnt = 0;
+	intr_set_level (old_level);
+
+	if (cnt > 0)
+		pool_put_pages (p, batch, cnt);
+}
+
+/* Tops up P's zero pool until it is full or P runs out of free
+   pages.  The pages come straight from the magazine and the free
+   lists: they do not count as used until zero_get() hands them
+   out, and a pool short of pages is left alone rather than
+   drained, which would only empty the zero pool being filled. */
+static void
+zero_fill (struct pool *p) {
+	for (;;) {
+		enum intr_level old_level;
+		bool full;
+		void *page;
+
+		old_level = intr_disable ();
+		full = p->zero.cnt >= ZERO_POOL_SIZE;
+		intr_set_level (old_level);
+		if (full)
+			return;
+
+		page = mag_get (p);
+		if (page == NULL)
+			return;
+		memset (page, 0, PGSIZE);
+
+		old_level = intr_disable ();
+		full = p->zero.cnt >= ZERO_POOL_SIZE;
+		if (!full)
+			p->zero.pages[p->zero.cnt++] = page;
+		intr_set_level (old_level);
+
+		if (full) {
+			mag_put (p, page);
+			return;
+		}
+	}
+}
+
+/* Page zeroing thread.  Refills both zero pools whenever asked.
+   It runs at PRI_MIN, so it only takes time that no other thread
+   wants. */
+static void
+zero_thread (void *aux UNUSED) {
+	if (thread_mlfqs)
+		thread_set_nice (20);
+
+	for (;;) {
+		sema_down (&zero_sema);
+		__atomic_store_n (&zero_wanted, false, __ATOMIC_RELEASE);
+		zero_fill (&kernel_pool);
+		zero_fill (&user_pool);
+	}
+}
+
+/* Adds PAGE_CNT pages to P's pages in use, raising the high-water
+   mark if needed. */
+static void
+count_used (struct pool *p, size_t page_cnt) {
+	size_t used = __atomic_add_fetch (&p->used_cnt, page_cnt, __ATOMIC_RELAXED);
+	size_t max = __atomic_load_n (&p->used_max, __ATOMIC_RELAXED);
+
+	while (used > max
+			&& !__atomic_compare_exchange_n (&p->used_max, &max, used, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+/* Prints statistics for pool P, named NAME.  Pages cached in the
+   magazine and the zero pool count as neither used nor free. */
+static void
+pool_print_stats (const char *name, struct pool *p) {
+	size_t free_cnt = 0, run = 0, largest = 0;
+	size_t cached = p->zero.cnt;
+
+	/* Walk the free blocks in address order, joining adjacent
+	   ones into runs. */
+	mutex_lock (&p->lock);
+	for (size_t i = 0; i < p->page_cnt; ) {
+		size_t n;
+
+		if (p->free_order[i] == NOT_FREE) {
+			run = 0;
+			i++;
+			continue;
+		}
+		n = (size_t) 1 << p->free_order[i];
+		free_cnt += n;
+		run += n;
+		if (run > largest)
+			largest = run;
+		i += n;
+	}
+	mutex_unlock (&p->lock);
+
+	cached += p->mag.cnt;
+
+	printf ("Palloc: %s pool: %zu pages, %zu used (peak %zu), %zu cached, "
+			"%zu free, largest free run %zu\n",
+			name, p->usable_cnt, p->used_cnt, p->used_max,
+			cached, free_cnt, largest);
+}
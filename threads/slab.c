@@ -0,0 +1,231 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <string.h>
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Slab allocator.
+
+   malloc() rounds every request up to a power of two, which
+   wastes up to half of each block for objects whose size falls
+   just past one, and funnels every size through a single lock.
+   A slab cache instead holds objects of one type, packed into
+   pages ("slabs") of exactly that object size.
+
+   Each slab begins with a header, followed by its objects.  Free
+   objects in a slab form a singly linked list threaded through
+   the objects themselves.  The cache keeps the slabs that have
+   free objects on its partial list; full slabs are not listed.
+   A slab whose objects are all free again is kept as the cache's
+   spare, or given back to the page allocator if there already is
+   one.
+
+   In front of the slabs sits a magazine of free objects, so that
+   most allocations and frees touch neither the cache lock nor the
+   slabs.  The magazine is refilled from, or flushed to, the
+   slabs SLAB_MAG_BATCH objects at a time. */
+
+/* Objects moved per magazine refill or flush. */
+#define SLAB_MAG_BATCH (SLAB_MAG_SIZE / 2)
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* Slab header, at the start of its page. */
+struct slab {
+	unsigned magic;                     /* Always set to SLAB_MAGIC. */
+	struct slab_cache *cache;           /* Owning cache. */
+	struct list_elem elem;              /* Element in cache's partial list. */
+	size_t free_cnt;                    /* Number of free objects. */
+	void *free;                         /* First free object. */
+};
+
+/* Free object. */
+struct free_obj {
+	struct free_obj *next;              /* Next free object in slab. */
+};
+
+static void *cache_get (struct slab_cache *);
+static void cache_put (struct slab_cache *, void *);
+static struct slab *obj_to_slab (struct slab_cache *, void *);
+
+/* Initializes cache C for objects of OBJ_SIZE bytes.  NAME
+   names the cache and its lock for debugging. */
+void
+slab_cache_init (struct slab_cache *c, const char *name, size_t obj_size) {
+	ASSERT (obj_size > 0);
+
+	c->name = name;
+	c->obj_size = ROUND_UP (obj_size, sizeof (void *));
+	c->objs_per_slab = (PGSIZE - sizeof (struct slab)) / c->obj_size;
+	ASSERT (c->objs_per_slab > 0);
+	mutex_init_named (&c->lock, name);
+	list_init (&c->partial);
+	c->spare = NULL;
+	c->mag.cnt = 0;
+}
+
+/* Allocates an object from cache C and returns it, with
+   unspecified contents.  Returns a null pointer if memory is not
+   available. */
+void *
+slab_alloc (struct slab_cache *c) {
+	struct slab_magazine *m;
+	void *batch[SLAB_MAG_BATCH];
+	enum intr_level old_level;
+	void *obj = NULL;
+	size_t cnt;
+
+	old_level = intr_disable ();
+	m = &c->mag;
+	if (m->cnt > 0)
+		obj = m->objs[--m->cnt];
+	intr_set_level (old_level);
+	if (obj != NULL)
+		return obj;
+
+	/* Refill the magazine from the slabs. */
+	mutex_lock (&c->lock);
+	for (cnt = 0; cnt < SLAB_MAG_BATCH; cnt++) {
+		batch[cnt] = cache_get (c);
+		if (batch[cnt] == NULL)
+			break;
+	}
+	mutex_unlock (&c->lock);
+	if (cnt == 0)
+		return NULL;
+	obj = batch[--cnt];
+
+	/* We may have been preempted while holding the lock, and the
+	   magazine refilled meanwhile.  Whatever does not fit goes
+	   back. */
+	old_level = intr_disable ();
+	m = &c->mag;
+	while (cnt > 0 && m->cnt < SLAB_MAG_SIZE)
+		m->objs[m->cnt++] = batch[--cnt];
+	intr_set_level (old_level);
+
+	if (cnt > 0) {
+		mutex_lock (&c->lock);
+		while (cnt > 0)
+			cache_put (c, batch[--cnt]);
+		mutex_unlock (&c->lock);
+	}
+	return obj;
+}
+
+/* Frees OBJ, which must have been allocated from cache C.  Does
+   nothing if OBJ is a null pointer. */
+void
+slab_free (struct slab_cache *c, void *obj) {
+	struct slab_magazine *m;
+	void *batch[SLAB_MAG_BATCH];
+	enum intr_level old_level;
+	size_t cnt = 0;
+
+	if (obj == NULL)
+		return;
+	obj_to_slab (c, obj);
+
+#ifndef NDEBUG
+	/* Clear the object to help detect use-after-free bugs. */
+	memset (obj, 0xcc, c->obj_size);
+#endif
+
+	old_level = intr_disable ();
+	m = &c->mag;
+	if (m->cnt == SLAB_MAG_SIZE) {
+		cnt = SLAB_MAG_BATCH;
+		m->cnt -= cnt;
+		memcpy (batch, &m->objs[m->cnt], cnt * sizeof *batch);
+	}
+	m->objs[m->cnt++] = obj;
+	intr_set_level (old_level);
+
+	if (cnt > 0) {
+		mutex_lock (&c->lock);
+		while (cnt > 0)
+			cache_put (c, batch[--cnt]);
+		mutex_unlock (&c->lock);
+	}
+}
+
+/* Takes a free object from C's slabs, adding a slab if there is
+   none.  Returns a null pointer if memory is not available.  C's
+   lock must be held. */
+static void *
+cache_get (struct slab_cache *c) {
+	struct slab *s;
+	struct free_obj *obj;
+
+	if (!list_empty (&c->partial))
+		s = list_entry (list_front (&c->partial), struct slab, elem);
+	else {
+		if (c->spare != NULL) {
+			s = c->spare;
+			c->spare = NULL;
+		} else {
+			uint8_t *objs;
+			size_t i;
+
+			s = palloc_get_page (0);
+			if (s == NULL)
+				return NULL;
+			s->magic = SLAB_MAGIC;
+			s->cache = c;
+			s->free_cnt = c->objs_per_slab;
+			s->free = NULL;
+			objs = (uint8_t *) (s + 1);
+			for (i = c->objs_per_slab; i-- > 0; ) {
+				struct free_obj *f = (struct free_obj *) (objs + i * c->obj_size);
+				f->next = s->free;
+				s->free = f;
+			}
+		}
+		list_push_front (&c->partial, &s->elem);
+	}
+
+	obj = s->free;
+	s->free = obj->next;
+	if (--s->free_cnt == 0)
+		list_remove (&s->elem);
+	return obj;
+}
+
+/* Returns OBJ to its slab in C.  C's lock must be held. */
+static void
+cache_put (struct slab_cache *c, void *obj_) {
+	struct slab *s = obj_to_slab (c, obj_);
+	struct free_obj *obj = obj_;
+
+	obj->next = s->free;
+	s->free = obj;
+	if (s->free_cnt++ == 0)
+		list_push_front (&c->partial, &s->elem);
+
+	if (s->free_cnt == c->objs_per_slab) {
+		list_remove (&s->elem);
+		if (c->spare == NULL)
+			c->spare = s;
+		else
+			palloc_free_page (s);
+	}
+}
+
+/* Returns the slab that OBJ, an object of cache C, is inside. */
+static struct slab *
+obj_to_slab (struct slab_cache *c, void *obj) {
+	struct slab *s = pg_round_down (obj);
+
+	/* Check that the slab is valid. */
+	ASSERT (s->magic == SLAB_MAGIC);
+	ASSERT (s->cache == c);
+
+	/* Check that the object is properly aligned for the slab. */
+	ASSERT ((pg_ofs (obj) - sizeof *s) % c->obj_size == 0);
+
+	return s;
+}
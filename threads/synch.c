@@ -27,10 +27,62 @@
    */
 
 #include "threads/synch.h"
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "devices/timer.h"
+#include "intrinsic.h"
+
+/* Maximum length of a chain of locks that a priority donation is
+   passed along.  Bounds the time lock_acquire() runs with
+   interrupts off.  The walk also stops at the first thread that
+   already has the donated priority. */
+#define DONATION_DEPTH_MAX 8
+
+static void donation_init (struct donation *);
+static void donate_priority (struct thread *donor);
+static void donate_chain (struct thread *, int priority, int depth);
+static void donate_readers (struct rwlock *, int priority, int depth);
+static void donation_raise (struct thread *holder, struct donation *,
+		int priority);
+static struct donation *waiting_for (const struct thread *,
+		struct thread **holder);
+static void inherit_donation (struct thread *, struct donation *,
+		struct waitq *waiters);
+static void drop_donation (struct thread *, struct donation *);
+static void refresh_priority (struct thread *);
+static void held_insert (struct thread *, struct donation *);
+static void held_remove (struct thread *, struct donation *);
+static void held_raise (struct thread *, struct donation *);
+static struct donation *held_meld (struct donation *, struct donation *);
+static struct donation *held_merge_pairs (struct donation *);
+static void sema_wake (struct semaphore *);
+static void lock_give_up (struct lock *);
+
+/* Contention statistics for the locks and mutexes of one name.
+   Times are in TSC ticks. */
+struct lock_stat {
+	const char *name;           /* Name given at initialization. */
+	uint64_t acquired;          /* Acquisitions. */
+	uint64_t contended;         /* Acquisitions that had to wait. */
+	uint64_t wait_total;        /* Time spent waiting. */
+	uint64_t wait_max;          /* Longest wait. */
+	uint64_t hold_total;        /* Time held. */
+};
+
+#define LOCK_STAT_MAX 128       /* Most names profiled. */
+#define LOCK_STAT_TOP 10        /* Names printed by lock_print_stats(). */
+
+bool lock_profile;
+static struct lock_stat lock_stats[LOCK_STAT_MAX];
+static size_t lock_stat_cnt;
+
+static struct lock_stat *lock_stat_find (const char *name);
+static void lock_stat_acquired (struct lock_stat *, uint64_t wait_start,
+		uint64_t *acquired_at);
+static void lock_stat_released (struct lock_stat *, uint64_t acquired_at);
 
 /* Initializes semaphore SEMA to VALUE.  A semaphore is a
    nonnegative integer along with two atomic operators for
@@ -46,7 +98,7 @@ sema_init (struct semaphore *sema, unsigned value) {
 	ASSERT (sema != NULL);
 
 	sema->value = value;
-	list_init (&sema->waiters);
+	waitq_init (&sema->waiters);
 }
 
 /* Down or "P" operation on a semaphore.  Waits for SEMA's value
@@ -66,7 +118,7 @@ sema_down (struct semaphore *sema) {
 
 	old_level = intr_disable ();
 	while (sema->value == 0) {
-		list_insert_ordered (&sema->waiters, &thread_current ()->elem, cmp_thrd_priorities, NULL);
+		waitq_push (&sema->waiters, thread_current ());
 		thread_block ();
 	}
 	sema->value--;
@@ -100,6 +152,8 @@ sema_try_down (struct semaphore *sema) {
 
 /* Up or "V" operation on a semaphore.  Increments SEMA's value
    and wakes up one thread of those waiting for SEMA, if any.
+   The highest-priority waiter is woken, or the one that has
+   waited longest among several.
 
    This function may be called from an interrupt handler. */
 void
@@ -109,17 +163,22 @@ sema_up (struct semaphore *sema) {
 	ASSERT (sema != NULL);
 
 	old_level = intr_disable ();
-	if (!list_empty (&sema->waiters)) {
-		list_sort (&sema->waiters, cmp_thrd_priorities, NULL);
-		thread_unblock (list_entry (list_pop_front (&sema->waiters),
-					struct thread, elem));
-	}
-	
-	sema->value++;
+	sema_wake (sema);
 	thread_yield_priority ();
 	intr_set_level (old_level);
 }
 
+/* Increments SEMA's value and wakes up its first waiter, if any,
+   without yielding to it.  Interrupts must be off. */
+static void
+sema_wake (struct semaphore *sema) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (!waitq_empty (&sema->waiters))
+		thread_unblock (waitq_pop (&sema->waiters));
+	sema->value++;
+}
+
 static void sema_test_helper (void *sema_);
 
 /* Self-test for semaphores that makes control "ping-pong"
@@ -169,13 +228,20 @@ sema_test_helper (void *sema_) {
    another one "up" it, but with a lock the same thread must both
    acquire and release it.  When these restrictions prove
    onerous, it's a good sign that a semaphore should be used,
-   instead of a lock. */
+   instead of a lock.
+
+   NAME identifies the lock in contention statistics and must
+   stay valid while the kernel runs.  lock_init() passes the
+   lock's own expression. */
 void
-lock_init (struct lock *lock) {
+lock_init_named (struct lock *lock, const char *name) {
 	ASSERT (lock != NULL);
 
 	lock->holder = NULL;
 	sema_init (&lock->semaphore, 1);
+	donation_init (&lock->donation);
+	lock->stat = lock_stat_find (name);
+	lock->acquired_at = 0;
 }
 
 /* Acquires LOCK, sleeping until it becomes available if
@@ -191,16 +257,19 @@ lock_acquire (struct lock *lock) {
 	enum intr_level old_level;
 	struct thread *curr;
 	struct thread *holder;
-	int max_priority;
+	uint64_t wait_start = 0;
 	
 	ASSERT (lock != NULL);
 	ASSERT (!intr_context ());
 	ASSERT (!lock_held_by_current_thread (lock));
 	
 	old_level = intr_disable ();
+	if (lock->stat != NULL && lock->semaphore.value == 0)
+		wait_start = rdtsc ();
 
 	if (thread_mlfqs) {
 		sema_down (&lock->semaphore);
+		lock_stat_acquired (lock->stat, wait_start, &lock->acquired_at);
 		intr_set_level (old_level);
 		lock->holder = thread_current ();
 		return;
@@ -208,38 +277,18 @@ lock_acquire (struct lock *lock) {
 
 	curr = thread_current ();
 	holder = lock->holder;
-	max_priority = PRI_MIN;
 	
 	if (holder) {
 		curr->lock = lock;
-		list_insert_ordered (&holder->donations, &curr->delem, 
-						cmp_thrd_donation_priorities, NULL);
-		max_priority = curr->priority;
-
-		struct thread *cursor = holder;
-		while (cursor->lock != NULL) {
-			if (max_priority < cursor->priority) {
-				max_priority = cursor->priority;
-			}
-
-			cursor->priority = max_priority;
-			cursor = cursor->lock->holder;
-			if (cursor == NULL) {
-				break;
-			}
-		}
-
-		if (cursor != NULL) {
-			cursor->priority = max_priority;
-		}
-
-		holder->priority = max_priority;
+		donate_priority (curr);
 	}
 
 	sema_down (&lock->semaphore);
-	intr_set_level (old_level);
 	curr->lock = NULL;
-	lock->holder = thread_current ();
+	lock->holder = curr;
+	inherit_donation (curr, &lock->donation, &lock->semaphore.waiters);
+	lock_stat_acquired (lock->stat, wait_start, &lock->acquired_at);
+	intr_set_level (old_level);
 }
 
 /* Tries to acquires LOCK and returns true if successful or false
@@ -256,8 +305,10 @@ lock_try_acquire (struct lock *lock) {
 	ASSERT (!lock_held_by_current_thread (lock));
 
 	success = sema_try_down (&lock->semaphore);
-	if (success)
+	if (success) {
 		lock->holder = thread_current ();
+		lock_stat_acquired (lock->stat, 0, &lock->acquired_at);
+	}
 	return success;
 }
 
@@ -269,60 +320,712 @@ lock_try_acquire (struct lock *lock) {
    handler. */
 void
 lock_release (struct lock *lock) {
-	struct thread *holder;
-	int max_priority;
+	enum intr_level old_level;
 
 	ASSERT (lock != NULL);
 	ASSERT (lock_held_by_current_thread (lock));
-	
-	if (thread_mlfqs) {
-		lock->holder = NULL;
-		sema_up (&lock->semaphore);
+
+	old_level = intr_disable ();
+	lock_give_up (lock);
+	thread_yield_priority ();
+	intr_set_level (old_level);
+}
+
+/* Releases LOCK, which must be owned by the current thread,
+   without yielding to a thread it wakes.  Interrupts must be
+   off. */
+static void
+lock_give_up (struct lock *lock) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	lock_stat_released (lock->stat, lock->acquired_at);
+	drop_donation (lock->holder, &lock->donation);
+	lock->holder = NULL;
+	sema_wake (&lock->semaphore);
+}
+
+/* Returns true if the current thread holds LOCK, false
+   otherwise.  (Note that testing whether some other thread holds
+   a lock would be racy.) */
+bool
+lock_held_by_current_thread (const struct lock *lock) {
+	ASSERT (lock != NULL);
+
+	return lock->holder == thread_current ();
+}
+
+/* Initializes D as a donation from no waiters. */
+static void
+donation_init (struct donation *d) {
+	d->priority = PRI_MIN;
+	d->held = false;
+	d->child = d->next = d->prev = NULL;
+}
+
+/* Passes DONOR's priority along the chain of threads holding the
+   locks, mutexes and rwlocks that DONOR, and in turn each of
+   them, waits for.  Each object on the way records the priority
+   as its donation, and each holder is raised to it.  Interrupts
+   must be off. */
+static void
+donate_priority (struct thread *donor) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (thread_mlfqs)
 		return;
+
+	donate_chain (donor, donor->priority, 0);
+}
+
+/* Passes PRIORITY on from T, which is DEPTH steps down the chain
+   from the donor. */
+static void
+donate_chain (struct thread *t, int priority, int depth) {
+	for (; depth < DONATION_DEPTH_MAX; depth++) {
+		struct thread *holder;
+		struct donation *d = waiting_for (t, &holder);
+
+		if (d == NULL)
+			break;
+		if (holder == NULL) {
+			/* A rwlock held by readers: each of them gets it. */
+			if (t->rwlock != NULL)
+				donate_readers (t->rwlock, priority, depth + 1);
+			break;
+		}
+		donation_raise (holder, d, priority);
+
+		/* A holder at PRIORITY or above already passed it on. */
+		if (holder->priority >= priority)
+			break;
+		thread_change_priority (holder, priority);
+		t = holder;
 	}
+}
 
-	holder = lock->holder;
-	holder->priority = holder->prev_priority;
-	for (struct list_elem *e = list_begin (&holder->donations);
-		e != list_end (&holder->donations);) {
+/* Passes PRIORITY to every thread holding RW for reading, and on
+   along the chain each of them waits in. */
+static void
+donate_readers (struct rwlock *rw, int priority, int depth) {
+	struct list_elem *e;
+
+	for (e = list_begin (&rw->readers); e != list_end (&rw->readers);
+			e = list_next (e)) {
+		struct rwlock_hold *hold = list_entry (e, struct rwlock_hold, elem);
+		struct thread *t = hold->reader;
+
+		donation_raise (t, &hold->donation, priority);
+		if (t->priority < priority) {
+			thread_change_priority (t, priority);
+			if (depth < DONATION_DEPTH_MAX)
+				donate_chain (t, priority, depth);
+		}
+	}
+}
+
+/* Raises donation D, which HOLDER holds, to at least PRIORITY and
+   makes sure it is in HOLDER's heap. */
+static void
+donation_raise (struct thread *holder, struct donation *d, int priority) {
+	if (d->priority < priority) {
+		d->priority = priority;
+		if (d->held)
+			held_raise (holder, d);
+	}
+	if (!d->held)
+		held_insert (holder, d);
+}
+
+/* Returns the donation of the lock, mutex or rwlock T waits for,
+   and stores its holder into *HOLDER.  Returns a null pointer if
+   T is not waiting for any.  A rwlock held by readers has no
+   single holder, so *HOLDER is null for it and the readers are
+   found through the rwlock. */
+static struct donation *
+waiting_for (const struct thread *t, struct thread **holder) {
+	if (t->lock != NULL) {
+		*holder = t->lock->holder;
+		return &t->lock->donation;
+	}
+	if (t->mutex != NULL) {
+		*holder = (struct thread *) (t->mutex->owner & ~MUTEX_WAITERS);
+		return &t->mutex->donation;
+	}
+	if (t->rwlock != NULL) {
+		*holder = t->rwlock->writer;
+		return &t->rwlock->donation;
+	}
+	return NULL;
+}
+
+/* T has just acquired the object whose donation is D.  Makes the
+   threads still on WAITERS donate to T, on top of whatever D
+   already holds.  Interrupts must be off. */
+static void
+inherit_donation (struct thread *t, struct donation *d,
+		struct waitq *waiters) {
+	struct thread *max;
 
-		struct thread *t = list_entry (e, struct thread, delem);
-		if (t->lock == lock) {
-			e = list_remove (e);
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (thread_mlfqs || waitq_empty (waiters))
+		return;
+
+	max = waitq_first (waiters);
+	donation_raise (t, d, max->priority);
+	if (t->priority < d->priority)
+		thread_change_priority (t, d->priority);
+}
+
+/* T, the running thread, is releasing the object whose donation
+   is D.  Drops D and recomputes T's priority.  Interrupts must be
+   off. */
+static void
+drop_donation (struct thread *t, struct donation *d) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (thread_mlfqs)
+		return;
+
+	held_remove (t, d);
+	donation_init (d);
+	refresh_priority (t);
+}
+
+/* Recomputes the priority of T, the running thread, from its own
+   priority and the highest donation it holds. */
+static void
+refresh_priority (struct thread *t) {
+	t->priority = t->prev_priority;
+	if (t->held != NULL && t->priority < t->held->priority)
+		t->priority = t->held->priority;
+}
+
+/* Adds D to T's heap of donations. */
+static void
+held_insert (struct thread *t, struct donation *d) {
+	ASSERT (!d->held);
+
+	d->held = true;
+	d->child = d->next = d->prev = NULL;
+	t->held = held_meld (t->held, d);
+	t->held->prev = NULL;
+}
+
+/* Removes D from T's heap of donations, if it is there. */
+static void
+held_remove (struct thread *t, struct donation *d) {
+	struct donation *sub;
+
+	if (!d->held)
+		return;
+
+	sub = held_merge_pairs (d->child);
+	if (d == t->held)
+		t->held = sub;
+	else {
+		/* Cut D's subtree out of its parent's child list. */
+		if (d->prev->child == d)
+			d->prev->child = d->next;
+		else
+			d->prev->next = d->next;
+		if (d->next != NULL)
+			d->next->prev = d->prev;
+		t->held = held_meld (t->held, sub);
+	}
+	if (t->held != NULL)
+		t->held->prev = NULL;
+	d->held = false;
+	d->child = d->next = d->prev = NULL;
+}
+
+/* Restores the heap order of T's heap after D's priority rose:
+   D's subtree, which is still ordered, is cut out and joined
+   with the rest. */
+static void
+held_raise (struct thread *t, struct donation *d) {
+	ASSERT (d->held);
+
+	if (d == t->held)
+		return;
+	if (d->prev->child == d)
+		d->prev->child = d->next;
+	else
+		d->prev->next = d->next;
+	if (d->next != NULL)
+		d->next->prev = d->prev;
+	d->next = d->prev = NULL;
+	t->held = held_meld (t->held, d);
+	t->held->prev = NULL;
+}
+
+/* Joins the heaps rooted at A and B, either of which may be
+   null, and returns the root of the result.  A and B must have
+   no siblings. */
+static struct donation *
+held_meld (struct donation *a, struct donation *b) {
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (b->priority > a->priority) {
+		struct donation *tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	b->prev = a;
+	b->next = a->child;
+	if (a->child != NULL)
+		a->child->prev = b;
+	a->child = b;
+	return a;
+}
+
+/* Joins the list of sibling heaps starting at FIRST into one
+   heap and returns its root, as waitq_merge_pairs() does. */
+static struct donation *
+held_merge_pairs (struct donation *first) {
+	struct donation *pairs = NULL;
+	struct donation *root = NULL;
+
+	while (first != NULL) {
+		struct donation *a = first;
+		struct donation *b = a->next;
+
+		first = b != NULL ? b->next : NULL;
+		a->next = a->prev = NULL;
+		if (b != NULL)
+			b->next = b->prev = NULL;
+		a = held_meld (a, b);
+		a->next = pairs;
+		pairs = a;
+	}
+
+	while (pairs != NULL) {
+		struct donation *next = pairs->next;
+		pairs->next = NULL;
+		root = held_meld (root, pairs);
+		pairs = next;
+	}
+	return root;
+}
+
+/* Initializes mutex M as unlocked.  NAME is used as in
+   lock_init_named(). */
+void
+mutex_init_named (struct mutex *m, const char *name) {
+	ASSERT (m != NULL);
+
+	m->owner = 0;
+	waitq_init (&m->waiters);
+	donation_init (&m->donation);
+	m->stat = lock_stat_find (name);
+	m->acquired_at = 0;
+}
+
+/* Acquires M if it is free.  Returns true on success.  This is
+   the fast path of mutex_lock(): a single compare-and-exchange,
+   with interrupts left on. */
+bool
+mutex_try_lock (struct mutex *m) {
+	uintptr_t expected = 0;
+
+	ASSERT (m != NULL);
+	ASSERT (!mutex_held_by_current_thread (m));
+
+	if (!__atomic_compare_exchange_n (&m->owner, &expected,
+				(uintptr_t) thread_current (), false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+	lock_stat_acquired (m->stat, 0, &m->acquired_at);
+	return true;
+}
+
+/* Acquires M, sleeping until it becomes available if necessary.
+   A sleeping waiter donates its priority to the owner, as with
+   locks.  The waiter queue and donation are protected by turning
+   interrupts off, which is enough because the kernel runs on one
+   CPU.  For the same reason M is never spun on: its owner cannot
+   be running while we wait, so spinning would only delay it.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+mutex_lock (struct mutex *m) {
+	struct thread *curr = thread_current ();
+	enum intr_level old_level;
+	uint64_t wait_start;
+
+	ASSERT (m != NULL);
+	ASSERT (!intr_context ());
+
+	if (mutex_try_lock (m))
+		return;
+
+	wait_start = m->stat != NULL ? rdtsc () : 0;
+	old_level = intr_disable ();
+	for (;;) {
+		uintptr_t v = __atomic_load_n (&m->owner, __ATOMIC_RELAXED);
+		struct thread *owner = (struct thread *) (v & ~MUTEX_WAITERS);
+
+		if (owner == NULL) {
+			/* Keep the waiters flag for the threads still asleep. */
+			uintptr_t new = (uintptr_t) curr
+				| (waitq_empty (&m->waiters) ? 0 : MUTEX_WAITERS);
+			if (__atomic_compare_exchange_n (&m->owner, &v, new, false,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				inherit_donation (curr, &m->donation, &m->waiters);
+				lock_stat_acquired (m->stat, wait_start, &m->acquired_at);
+				break;
+			}
 			continue;
 		}
 
-		e = list_next (e);
+		/* Make sure the owner wakes us, then sleep. */
+		if (!(v & MUTEX_WAITERS)
+				&& !__atomic_compare_exchange_n (&m->owner, &v, v | MUTEX_WAITERS,
+					false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		curr->mutex = m;
+		donate_priority (curr);
+		waitq_push (&m->waiters, curr);
+		thread_block ();
+		curr->mutex = NULL;
 	}
+	intr_set_level (old_level);
+}
 
-	if (!list_empty (&holder->donations)) {
-		list_sort (&holder->donations, cmp_thrd_donation_priorities, NULL);
-		max_priority = list_entry (list_begin (&holder->donations), 
-					struct thread, delem)->priority;
-		if (holder->priority < max_priority) {
-			holder->priority = max_priority;
-		}
+/* Releases M, which must be owned by the current thread, and
+   wakes up its highest-priority waiter, if any. */
+void
+mutex_unlock (struct mutex *m) {
+	struct thread *curr = thread_current ();
+	uintptr_t expected = (uintptr_t) curr;
+	enum intr_level old_level;
+
+	ASSERT (m != NULL);
+	ASSERT (mutex_held_by_current_thread (m));
+
+	lock_stat_released (m->stat, m->acquired_at);
+
+	/* Fast path: nobody waits. */
+	if (__atomic_compare_exchange_n (&m->owner, &expected, 0, false,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+
+	old_level = intr_disable ();
+	drop_donation (curr, &m->donation);
+	__atomic_store_n (&m->owner, 0, __ATOMIC_RELEASE);
+	if (!waitq_empty (&m->waiters))
+		thread_unblock (waitq_pop (&m->waiters));
+	thread_yield_priority ();
+	intr_set_level (old_level);
+}
+
+/* Returns true if the current thread owns M, false otherwise. */
+bool
+mutex_held_by_current_thread (const struct mutex *m) {
+	ASSERT (m != NULL);
+
+	return (m->owner & ~MUTEX_WAITERS) == (uintptr_t) thread_current ();
+}
+
+static void rwlock_wait (struct rwlock *, struct waitq *waiters);
+static void rwlock_add_reader (struct rwlock *, struct thread *);
+static void rwlock_set_writer (struct rwlock *, struct thread *);
+static struct rwlock_hold *rwlock_find_hold (struct thread *,
+		const struct rwlock *);
+
+/* Initializes RW as unlocked. */
+void
+rwlock_init (struct rwlock *rw) {
+	ASSERT (rw != NULL);
+
+	rw->writer = NULL;
+	list_init (&rw->readers);
+	waitq_init (&rw->read_waiters);
+	waitq_init (&rw->write_waiters);
+	donation_init (&rw->donation);
+}
+
+/* Acquires RW for reading, sleeping while a writer holds or
+   waits for it.  A thread that already holds RWLOCK_HOLDS_MAX
+   rwlocks for reading gets RW for writing instead, which
+   excludes more than it needs to but is otherwise the same to
+   the caller.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_read_acquire (struct rwlock *rw) {
+	enum intr_level old_level;
+
+	ASSERT (rw != NULL);
+	ASSERT (!intr_context ());
+	ASSERT (!rwlock_held_by_current_thread (rw));
+	ASSERT (rwlock_find_hold (thread_current (), rw) == NULL);
+
+	if (rwlock_find_hold (thread_current (), NULL) == NULL) {
+		rwlock_write_acquire (rw);
+		return;
 	}
 
-	lock->holder = NULL;
-	sema_up (&lock->semaphore);
+	old_level = intr_disable ();
+	if (rw->writer == NULL && waitq_empty (&rw->write_waiters))
+		rwlock_add_reader (rw, thread_current ());
+	else
+		rwlock_wait (rw, &rw->read_waiters);
+	intr_set_level (old_level);
 }
 
-/* Returns true if the current thread holds LOCK, false
+/* Releases RW, which the current thread holds for reading.  The
+   last reader out hands RW to the highest-priority writer
+   waiting, if any. */
+void
+rwlock_read_release (struct rwlock *rw) {
+	struct thread *curr = thread_current ();
+	struct rwlock_hold *hold;
+	enum intr_level old_level;
+
+	ASSERT (rw != NULL);
+
+	/* Taken for writing by rwlock_read_acquire(). */
+	if (rw->writer == curr) {
+		rwlock_write_release (rw);
+		return;
+	}
+
+	old_level = intr_disable ();
+	hold = rwlock_find_hold (curr, rw);
+	ASSERT (hold != NULL);
+	list_remove (&hold->elem);
+	hold->rw = NULL;
+
+	if (list_empty (&rw->readers) && !waitq_empty (&rw->write_waiters))
+		rwlock_set_writer (rw, waitq_pop (&rw->write_waiters));
+
+	/* Drop whatever waiting writers donated to us. */
+	drop_donation (curr, &hold->donation);
+	thread_yield_priority ();
+	intr_set_level (old_level);
+}
+
+/* Acquires RW for writing, sleeping until no other thread holds
+   it.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_write_acquire (struct rwlock *rw) {
+	enum intr_level old_level;
+
+	ASSERT (rw != NULL);
+	ASSERT (!intr_context ());
+	ASSERT (!rwlock_held_by_current_thread (rw));
+	ASSERT (rwlock_find_hold (thread_current (), rw) == NULL);
+
+	old_level = intr_disable ();
+	if (rw->writer == NULL && list_empty (&rw->readers))
+		rw->writer = thread_current ();
+	else
+		rwlock_wait (rw, &rw->write_waiters);
+	intr_set_level (old_level);
+}
+
+/* Releases RW, which the current thread holds for writing.  If
+   readers are waiting, all of them get RW; otherwise the
+   highest-priority writer waiting does. */
+void
+rwlock_write_release (struct rwlock *rw) {
+	struct thread *curr = thread_current ();
+	enum intr_level old_level;
+
+	ASSERT (rw != NULL);
+	ASSERT (rwlock_held_by_current_thread (rw));
+
+	old_level = intr_disable ();
+	drop_donation (curr, &rw->donation);
+	rw->writer = NULL;
+	if (!waitq_empty (&rw->read_waiters)) {
+		while (!waitq_empty (&rw->read_waiters)) {
+			struct thread *t = waitq_pop (&rw->read_waiters);
+			rwlock_add_reader (rw, t);
+			thread_unblock (t);
+		}
+	} else if (!waitq_empty (&rw->write_waiters))
+		rwlock_set_writer (rw, waitq_pop (&rw->write_waiters));
+	thread_yield_priority ();
+	intr_set_level (old_level);
+}
+
+/* Returns true if the current thread holds RW for writing, false
    otherwise.  (Note that testing whether some other thread holds
-   a lock would be racy.) */
+   it would be racy.) */
 bool
-lock_held_by_current_thread (const struct lock *lock) {
-	ASSERT (lock != NULL);
+rwlock_held_by_current_thread (const struct rwlock *rw) {
+	ASSERT (rw != NULL);
 
-	return lock->holder == thread_current ();
+	return rw->writer == thread_current ();
+}
+
+/* Puts the current thread to sleep on WAITERS, one of RW's wait
+   lists, after donating its priority to RW's holders.  The
+   releasing thread hands RW over before waking us, so there is
+   nothing to retry.  Interrupts must be off. */
+static void
+rwlock_wait (struct rwlock *rw, struct waitq *waiters) {
+	struct thread *curr = thread_current ();
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	curr->rwlock = rw;
+	donate_priority (curr);
+	waitq_push (waiters, curr);
+	thread_block ();
+}
+
+/* Gives T, which was waiting for RW or is the running thread, a
+   hold on RW for reading.  T inherits the donations of the
+   writers still waiting. */
+static void
+rwlock_add_reader (struct rwlock *rw, struct thread *t) {
+	struct rwlock_hold *hold = rwlock_find_hold (t, NULL);
+
+	/* rwlock_read_acquire() made sure T has one. */
+	ASSERT (hold != NULL);
+
+	t->rwlock = NULL;
+	hold->rw = rw;
+	hold->reader = t;
+	donation_init (&hold->donation);
+	list_push_back (&rw->readers, &hold->elem);
+	inherit_donation (t, &hold->donation, &rw->write_waiters);
+}
+
+/* Hands RW to T, a writer that was waiting for it, and wakes T.
+   T inherits the donations of the writers still waiting and of
+   the readers queued behind them, who now wait for T. */
+static void
+rwlock_set_writer (struct rwlock *rw, struct thread *t) {
+	t->rwlock = NULL;
+	rw->writer = t;
+	inherit_donation (t, &rw->donation, &rw->write_waiters);
+	inherit_donation (t, &rw->donation, &rw->read_waiters);
+	thread_unblock (t);
+}
+
+/* Returns T's hold on RW, or an unused hold of T's if RW is
+   null, or a null pointer if there is none. */
+static struct rwlock_hold *
+rwlock_find_hold (struct thread *t, const struct rwlock *rw) {
+	for (int i = 0; i < RWLOCK_HOLDS_MAX; i++)
+		if (t->read_holds[i].rw == rw)
+			return &t->read_holds[i];
+	return NULL;
+}
+
+/* Returns the statistics kept for locks named NAME, creating
+   them if necessary, or a null pointer if profiling is off or
+   too many names are in use. */
+static struct lock_stat *
+lock_stat_find (const char *name) {
+	struct lock_stat *s = NULL;
+	enum intr_level old_level;
+
+	if (!lock_profile || name == NULL)
+		return NULL;
+
+	old_level = intr_disable ();
+	for (size_t i = 0; i < lock_stat_cnt; i++)
+		if (!strcmp (lock_stats[i].name, name)) {
+			s = &lock_stats[i];
+			break;
+		}
+	if (s == NULL && lock_stat_cnt < LOCK_STAT_MAX) {
+		s = &lock_stats[lock_stat_cnt++];
+		s->name = name;
+	}
+	intr_set_level (old_level);
+	return s;
+}
+
+/* Counts an acquisition in S, if S is nonnull, and stores the
+   current time into *ACQUIRED_AT.  WAIT_START is when the
+   acquirer started waiting, or 0 if it did not wait.  Several
+   CPUs may update S at once, so the sums are added atomically
+   and the maximum is raised with compare-and-swap. */
+static void
+lock_stat_acquired (struct lock_stat *s, uint64_t wait_start,
+		uint64_t *acquired_at) {
+	uint64_t now;
+
+	if (s == NULL)
+		return;
+
+	now = rdtsc ();
+	*acquired_at = now;
+	__atomic_fetch_add (&s->acquired, 1, __ATOMIC_RELAXED);
+	if (wait_start != 0) {
+		uint64_t wait = now - wait_start;
+		uint64_t max = __atomic_load_n (&s->wait_max, __ATOMIC_RELAXED);
+
+		__atomic_fetch_add (&s->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add (&s->wait_total, wait, __ATOMIC_RELAXED);
+		while (wait > max
+				&& !__atomic_compare_exchange_n (&s->wait_max, &max, wait, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+	}
+}
+
+/* Counts the time since ACQUIRED_AT as hold time in S, if S is
+   nonnull. */
+static void
+lock_stat_released (struct lock_stat *s, uint64_t acquired_at) {
+	if (s != NULL)
+		__atomic_fetch_add (&s->hold_total, rdtsc () - acquired_at,
+				__ATOMIC_RELAXED);
+}
+
+/* Prints the statistics of the LOCK_STAT_TOP most contended lock
+   names. */
+void
+lock_print_stats (void) {
+	struct lock_stat *top[LOCK_STAT_TOP];
+	size_t top_cnt = 0;
+
+	/* Insertion sort by contended acquisitions, then wait time. */
+	for (size_t i = 0; i < lock_stat_cnt; i++) {
+		struct lock_stat *s = &lock_stats[i];
+		size_t j;
+
+		for (j = top_cnt; j > 0; j--) {
+			struct lock_stat *t = top[j - 1];
+			if (t->contended > s->contended
+					|| (t->contended == s->contended
+						&& t->wait_total >= s->wait_total))
+				break;
+			if (j < LOCK_STAT_TOP)
+				top[j] = t;
+		}
+		if (j < LOCK_STAT_TOP) {
+			top[j] = s;
+			if (top_cnt < LOCK_STAT_TOP)
+				top_cnt++;
+		}
+	}
+
+	printf ("Locks: %zu names profiled, most contended:\n", lock_stat_cnt);
+	for (size_t i = 0; i < top_cnt; i++) {
+		struct lock_stat *s = top[i];
+		printf ("  %-24s %'"PRIu64" acquired, %'"PRIu64" contended, "
+				"wait %'"PRIu64" us (max %'"PRIu64"), held %'"PRIu64" us\n",
+				s->name, s->acquired, s->contended,
+				timer_tsc_to_us (s->wait_total), timer_tsc_to_us (s->wait_max),
+				timer_tsc_to_us (s->hold_total));
+	}
 }
-
-/* One semaphore in a list. */
-struct semaphore_elem {
-	struct list_elem elem;              /* List element. */
-	struct semaphore semaphore;         /* This semaphore. */
-};
 
 /* Initializes condition variable COND.  A condition variable
    allows one piece of code to signal a condition and cooperating
@@ -331,7 +1034,7 @@ void
 cond_init (struct condition *cond) {
 	ASSERT (cond != NULL);
 
-	list_init (&cond->waiters);
+	waitq_init (&cond->waiters);
 }
 
 /* Atomically releases LOCK and waits for COND to be signaled by
@@ -356,39 +1059,48 @@ cond_init (struct condition *cond) {
    we need to sleep. */
 void
 cond_wait (struct condition *cond, struct lock *lock) {
-	struct semaphore_elem waiter;
+	enum intr_level old_level;
 
 	ASSERT (cond != NULL);
 	ASSERT (lock != NULL);
 	ASSERT (!intr_context ());
 	ASSERT (lock_held_by_current_thread (lock));
 
-	sema_init (&waiter.semaphore, 0);
-	list_insert_ordered (&cond->waiters, &waiter.elem, cmp_sema_waiters_priorities, NULL);
-	lock_release (lock);
-	sema_down (&waiter.semaphore);
+	/* Releasing LOCK must not yield: a signal could then find us
+	   queued on COND but not yet blocked.  LOCK goes first, since
+	   giving up its donation can lower our priority, which keys
+	   our place on COND. */
+	old_level = intr_disable ();
+	lock_give_up (lock);
+	waitq_push (&cond->waiters, thread_current ());
+	thread_block ();
+	intr_set_level (old_level);
 	lock_acquire (lock);
 }
 
 /* If any threads are waiting on COND (protected by LOCK), then
-   this function signals one of them to wake up from its wait.
-   LOCK must be held before calling this function.
+   this function signals the highest-priority one to wake up
+   from its wait.  LOCK must be held before calling this
+   function.
 
    An interrupt handler cannot acquire a lock, so it does not
    make sense to try to signal a condition variable within an
    interrupt handler. */
 void
 cond_signal (struct condition *cond, struct lock *lock UNUSED) {
+	enum intr_level old_level;
+
 	ASSERT (cond != NULL);
 	ASSERT (lock != NULL);
 	ASSERT (!intr_context ());
 	ASSERT (lock_held_by_current_thread (lock));
 
-	if (!list_empty (&cond->waiters)) {
-		list_sort (&cond->waiters, cmp_sema_waiters_priorities, NULL);
-		sema_up (&list_entry (list_pop_front (&cond->waiters),
-					struct semaphore_elem, elem)->semaphore);
+	old_level = intr_disable ();
+	if (!waitq_empty (&cond->waiters)) {
+		thread_unblock (waitq_pop (&cond->waiters));
+		thread_yield_priority ();
 	}
+	intr_set_level (old_level);
 }
 
 /* Wakes up all threads, if any, waiting on COND (protected by
@@ -402,17 +1114,180 @@ cond_broadcast (struct condition *cond, struct lock *lock) {
 	ASSERT (cond != NULL);
 	ASSERT (lock != NULL);
 
-	while (!list_empty (&cond->waiters))
+	while (!waitq_empty (&cond->waiters))
 		cond_signal (cond, lock);
 }
 
+/* Returns the thread that contains wait queue element E. */
+#define wq_thread(E) \
+	((struct thread *) ((uint8_t *) (E) - offsetof (struct thread, wq_elem)))
+
+static struct waitq_elem *waitq_meld (struct waitq_elem *,
+		struct waitq_elem *);
+static struct waitq_elem *waitq_merge_pairs (struct waitq_elem *);
+static void waitq_insert (struct waitq *, struct waitq_elem *);
+static bool waitq_before (const struct waitq_elem *,
+		const struct waitq_elem *);
+
+/* Initializes Q as an empty wait queue. */
+void
+waitq_init (struct waitq *q) {
+	ASSERT (q != NULL);
+
+	q->root = NULL;
+	q->seq = 0;
+}
+
+/* Returns true if Q is empty, false otherwise. */
 bool
-cmp_sema_waiters_priorities (const struct list_elem *lhs, const struct list_elem *rhs, void *aux UNUSED) {
-	struct semaphore left_sema = list_entry (lhs, struct semaphore_elem, elem)->semaphore;
-	struct semaphore right_sema = list_entry (rhs, struct semaphore_elem, elem)->semaphore;
+waitq_empty (const struct waitq *q) {
+	return q->root == NULL;
+}
+
+/* Adds T to the back of Q among the threads of its priority.
+   Interrupts must be off. */
+void
+waitq_push (struct waitq *q, struct thread *t) {
+	struct waitq_elem *e = &t->wq_elem;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	ASSERT (e->q == NULL);
+
+	e->seq = q->seq++;
+	waitq_insert (q, e);
+}
+
+/* Returns the thread that Q would pop next, or a null pointer if
+   Q is empty. */
+struct thread *
+waitq_first (const struct waitq *q) {
+	return q->root != NULL ? wq_thread (q->root) : NULL;
+}
+
+/* Removes and returns the highest-priority thread in Q, which
+   must not be empty.  Interrupts must be off. */
+struct thread *
+waitq_pop (struct waitq *q) {
+	struct thread *t;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	ASSERT (!waitq_empty (q));
+
+	t = wq_thread (q->root);
+	waitq_remove (t);
+	return t;
+}
+
+/* Removes T from the wait queue it is in.  Interrupts must be
+   off. */
+void
+waitq_remove (struct thread *t) {
+	struct waitq_elem *e = &t->wq_elem;
+	struct waitq *q = e->q;
+	struct waitq_elem *sub;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	ASSERT (q != NULL);
+
+	sub = waitq_merge_pairs (e->child);
+	if (e == q->root)
+		q->root = sub;
+	else {
+		/* Cut E's subtree out of its parent's child list. */
+		if (e->prev->child == e)
+			e->prev->child = e->next;
+		else
+			e->prev->next = e->next;
+		if (e->next != NULL)
+			e->next->prev = e->prev;
+		q->root = waitq_meld (q->root, sub);
+	}
+	if (q->root != NULL)
+		q->root->prev = NULL;
+	e->child = e->next = e->prev = NULL;
+	e->q = NULL;
+}
+
+/* Moves T within its wait queue after its priority changed.  T
+   keeps its place among threads of its new priority.  Interrupts
+   must be off. */
+void
+waitq_update (struct thread *t) {
+	struct waitq *q = t->wq_elem.q;
+
+	ASSERT (q != NULL);
+
+	waitq_remove (t);
+	waitq_insert (q, &t->wq_elem);
+}
 
-	struct thread *left_thrd = list_entry (list_begin (&left_sema.waiters), struct thread, elem);
-	struct thread *right_thrd = list_entry (list_begin (&right_sema.waiters), struct thread, elem);
+/* Adds E, whose arrival number is already set, to Q. */
+static void
+waitq_insert (struct waitq *q, struct waitq_elem *e) {
+	e->child = e->next = e->prev = NULL;
+	e->q = q;
+	q->root = waitq_meld (q->root, e);
+	q->root->prev = NULL;
+}
 
-	return left_thrd->priority > right_thrd->priority;
-}
\ No newline at end of file
+/* Returns true if A leaves its wait queue before B. */
+static bool
+waitq_before (const struct waitq_elem *a, const struct waitq_elem *b) {
+	int a_pri = wq_thread (a)->priority;
+	int b_pri = wq_thread (b)->priority;
+
+	return a_pri > b_pri || (a_pri == b_pri && a->seq < b->seq);
+}
+
+/* Joins the heaps rooted at A and B, either of which may be
+   null, and returns the root of the result.  A and B must have
+   no siblings. */
+static struct waitq_elem *
+waitq_meld (struct waitq_elem *a, struct waitq_elem *b) {
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (waitq_before (b, a)) {
+		struct waitq_elem *tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	b->prev = a;
+	b->next = a->child;
+	if (a->child != NULL)
+		a->child->prev = b;
+	a->child = b;
+	return a;
+}
+
+/* Joins the list of sibling heaps starting at FIRST into one
+   heap and returns its root: first in pairs from left to right,
+   then the pairs from right to left. */
+static struct waitq_elem *
+waitq_merge_pairs (struct waitq_elem *first) {
+	struct waitq_elem *pairs = NULL;
+	struct waitq_elem *root = NULL;
+
+	while (first != NULL) {
+		struct waitq_elem *a = first;
+		struct waitq_elem *b = a->next;
+
+		first = b != NULL ? b->next : NULL;
+		a->next = a->prev = NULL;
+		if (b != NULL)
+			b->next = b->prev = NULL;
+		a = waitq_meld (a, b);
+		a->next = pairs;
+		pairs = a;
+	}
+
+	while (pairs != NULL) {
+		struct waitq_elem *next = pairs->next;
+		pairs->next = NULL;
+		root = waitq_meld (root, pairs);
+		pairs = next;
+	}
+	return root;
+}
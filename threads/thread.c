@@ -1,16 +1,18 @@
 #include "threads/thread.h"
 #include <debug.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <random.h>
 #include <stdio.h>
 #include <string.h>
 #include <fixed.h>
-#include "threads/flags.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
 #include "threads/palloc.h"
+#include "threads/switch.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "devices/timer.h"
 #include "intrinsic.h"
 #ifdef USERPROG
 #include "userprog/process.h"
@@ -25,12 +27,30 @@
    Do not modify this value. */
 #define THREAD_BASIC 0xd42df210
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
-
-/* List of processes in THREAD_BLOCK state */
-static struct list block_list;
+/* Run queue of processes in THREAD_READY state, that is,
+   processes that are ready to run but not actually running.
+   There is one FIFO list per priority, and bit N of
+   ready_bitmap is set iff ready_queues[N] is nonempty, so the
+   highest runnable priority is found with a single bit scan. */
+static struct list ready_queues[PRI_MAX + 1];
+static uint64_t ready_bitmap;
+static size_t ready_cnt;		/* # of threads in the run queue. */
+
+/* Sleep queue of processes parked by timer_sleep().  This is a
+   hashed timing wheel: a thread parked until tick T sits in
+   sleep_wheel[T % SLEEP_WHEEL_SIZE], and each slot is ordered by
+   wake-up tick.  next_unpark caches the earliest wake-up tick of
+   all parked threads, so that timer ticks with nothing due do no
+   work at all.
+
+   The timer interrupt unparks at most UNPARK_BATCH threads per
+   tick, so that its time with interrupts off stays bounded; any
+   others due wait for the next tick.  Parking still inserts into
+   a slot in time linear in the threads already in it. */
+#define SLEEP_WHEEL_SIZE 64
+#define UNPARK_BATCH 16
+static struct list sleep_wheel[SLEEP_WHEEL_SIZE];
+static int64_t next_unpark;
 
 /* List of all processes */
 static struct list thread_list;
@@ -38,38 +58,113 @@ static struct list thread_list;
 /* Idle thread. */
 static struct thread *idle_thread;
 
+/* All processes, hashed by tid.  Tids are allocated
+   sequentially, so they spread evenly over the buckets. */
+#define TID_HASH_SIZE 64
+static struct list tid_hash[TID_HASH_SIZE];
+
 /* Initial thread, the thread running init.c:main(). */
 static struct thread *initial_thread;
 
 /* Lock used by allocate_tid(). */
-static struct lock tid_lock;
+static struct mutex tid_lock;
 
 /* Thread destruction requests */
 static struct list destruction_req;
 
+/* Pages of exited threads kept for reuse by thread_create(),
+   instead of returning them to palloc. */
+#define THREAD_CACHE_MAX 8
+static struct list thread_cache;
+static size_t thread_cache_cnt;	/* # of pages in thread_cache. */
+
 /* Statistics. */
 static long long idle_ticks;    /* # of timer ticks spent idle. */
 static long long kernel_ticks;  /* # of timer ticks in kernel threads. */
 static long long user_ticks;    /* # of timer ticks in user programs. */
 
-/* Scheduling. */
+/* Idle residency histogram: idle_hist[0] counts waits under
+   1 us, idle_hist[N] waits of [2**(N-1), 2**N) us.  The last
+   bucket also counts all longer waits. */
+#define IDLE_HIST_CNT 24
+static long long idle_hist[IDLE_HIST_CNT];
+static uint64_t idle_cycles;	/* Total time spent waiting. */
+static uint64_t idle_start;		/* Start of current wait, or 0. */
 
+/* Scheduling. */
 static unsigned thread_ticks;   /* # of timer ticks since last yield. */
 static fixed load_avg;			/* Load average */
 
+/* BSD scheduler.  recent_cpu decays once per second, but instead
+   of sweeping every thread, the decay factors of the last
+   DECAY_HISTORY seconds are kept here and a thread catches up on
+   the ones it missed the next time it is examined: when it is
+   unblocked, picked to run, or reached by decay_ready().  Decays
+   older than that are dropped: by then recent_cpu has converged,
+   so their contribution is below fixed-point precision.
+
+   To bound the catch-up, each run of DECAY_GROUP decays is also
+   kept composed into one step: applying it to recent_cpu R of a
+   thread with nice N gives A * R + B * N. */
+#define DECAY_HISTORY 1024
+#define DECAY_GROUP 32
+#define DECAY_GROUP_CNT (DECAY_HISTORY / DECAY_GROUP)
+static fixed decay_history[DECAY_HISTORY];
+static struct decay_group {
+	fixed a, b;
+} decay_groups[DECAY_GROUP_CNT];
+static int64_t decay_epoch;		/* # of decays since boot. */
+
+/* Stale ready threads brought up to date per timer tick. */
+#define DECAY_BATCH 4
+
 /* If false (default), use round-robin scheduler.
    If true, use multi-level feedback queue scheduler.
    Controlled by kernel command-line option "-o mlfqs". */
 bool thread_mlfqs;
 
+/* If true, print per-thread scheduling statistics at shutdown.
+   Controlled by kernel command-line option "-schedstats". */
+bool thread_sched_stats;
+
+/* How an idle CPU waits for work.
+   Controlled by kernel command-line option "-idle=MODE". */
+enum idle_mode thread_idle_mode;
+
+/* CPUID.1:ECX bit for MONITOR/MWAIT. */
+#define CPUID_MONITOR (1 << 3)
+
+/* Scheduling statistics of threads that have already exited. */
+static struct thread_sched_stats exited_stats;
+static size_t exited_cnt;
+
 static void kernel_thread (thread_func *, void *aux);
 
 static void idle (void *aux UNUSED);
+static void idle_wait (void);
+static void idle_end (void);
 static struct thread *next_thread_to_run (void);
 static void init_thread (struct thread *, const char *name, int priority);
 static void do_schedule(int status);
 static void schedule (void);
+static void yield (bool preempted);
+static void sched_stats_switch (struct thread *curr, struct thread *next);
+static void sched_stats_print (const char *name, tid_t tid,
+				const struct thread_sched_stats *);
 static tid_t allocate_tid (void);
+static struct thread *thread_page_get (void);
+static void thread_page_put (struct thread *);
+static void tid_hash_insert (struct thread *);
+static void ready_push (struct thread *);
+static int ready_max_priority (void);
+static void rq_insert (struct thread *);
+static void rq_erase (struct thread *);
+static void rq_requeue (struct thread *, int priority);
+static int mlfqs_priority (const struct thread *);
+static void decay_ready (void);
+static void rq_requeue_tail (struct thread *, int priority);
+static bool cmp_thrd_parked (const struct list_elem *,
+					const struct list_elem *, void *aux UNUSED);
 
 /* Returns true if T appears to point to a valid thread. */
 #define is_thread(t) ((t) != NULL && (t)->magic == THREAD_MAGIC)
@@ -81,6 +176,9 @@ static tid_t allocate_tid (void);
  * somewhere in the middle, this locates the curent thread. */
 #define running_thread() ((struct thread *) (pg_round_down (rrsp ())))
 
+/* Returns true if T is the idle thread. */
+#define is_idle(t) ((t) == idle_thread)
+
 
 // Global descriptor table for the thread_start.
 // Because the gdt will be setup after the thread_init, we should
@@ -114,25 +212,44 @@ thread_init (void) {
 	lgdt (&gdt_ds);
 
 	/* Init the globla thread context */
-	lock_init (&tid_lock);
-	list_init (&ready_list);
-	list_init (&block_list);
-	list_init (&thread_list);
+	mutex_init (&tid_lock);
+	for (int p = PRI_MIN; p <= PRI_MAX; p++)
+		list_init (&ready_queues[p]);
 	list_init (&destruction_req);
+	list_init (&thread_cache);
+	for (int i = 0; i < SLEEP_WHEEL_SIZE; i++)
+		list_init (&sleep_wheel[i]);
+	next_unpark = INT64_MAX;
+	list_init (&thread_list);
+	for (int i = 0; i < TID_HASH_SIZE; i++)
+		list_init (&tid_hash[i]);
 	
 	/* Set up a thread structure for the running thread. */
 	initial_thread = running_thread ();
 	init_thread (initial_thread, "main", PRI_DEFAULT);
 	initial_thread->status = THREAD_RUNNING;
 	initial_thread->tid = allocate_tid ();
+	tid_hash_insert (initial_thread);
+	initial_thread->stats.run_start = rdtsc ();
 }
 
 /* Starts preemptive thread scheduling by enabling interrupts.
    Also creates the idle thread. */
 void
 thread_start (void) {
-	/* Create the idle thread. */
 	struct semaphore idle_started;
+
+	if (thread_idle_mode == IDLE_MWAIT) {
+		uint32_t eax, ebx, ecx, edx;
+
+		cpuid (1, 0, &eax, &ebx, &ecx, &edx);
+		if (!(ecx & CPUID_MONITOR)) {
+			printf ("No MONITOR/MWAIT, idling with HLT.\n");
+			thread_idle_mode = IDLE_HLT;
+		}
+	}
+
+	/* Create the idle thread. */
 	sema_init (&idle_started, 0);
 	thread_create ("idle", PRI_MIN, idle, &idle_started);
 
@@ -147,21 +264,48 @@ thread_start (void) {
    Thus, this function runs in an external interrupt context. */
 void
 thread_tick (void) {
-	struct thread *t = thread_current ();
+	thread_account_ticks (1);
+	if (thread_mlfqs)
+		decay_ready ();
+
+	/* Enforce preemption. */
+	if (++thread_ticks >= TIME_SLICE)
+		intr_yield_on_return ();
+}
+
+/* Charges N timer ticks to the running thread's statistics.
+   May be called from schedule(), while the thread is switching
+   out. */
+void
+thread_account_ticks (int64_t n) {
+	struct thread *t = running_thread ();
 
-	/* Update statistics. */
 	if (t == idle_thread)
-		idle_ticks++;
+		idle_ticks += n;
 #ifdef USERPROG
 	else if (t->pml4 != NULL)
-		user_ticks++;
+		user_ticks += n;
 #endif
 	else
-		kernel_ticks++;
+		kernel_ticks += n;
+}
 
-	/* Enforce preemption. */
-	if (++thread_ticks >= TIME_SLICE)
-		intr_yield_on_return ();
+/* Returns the first tick after NOW on which the timer has work to
+   do: a parked thread's wake-up or the end of the running
+   thread's time slice.  Returns INT64_MAX if there is none.  Used
+   by the tickless timer. */
+int64_t
+thread_next_tick (int64_t now) {
+	int64_t next = next_unpark;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (running_thread () != idle_thread) {
+		int64_t slice_end = now + TIME_SLICE - thread_ticks;
+		if (slice_end < next)
+			next = slice_end;
+	}
+	return next;
 }
 
 /* Called by timer_sleep() in timer.c 
@@ -175,7 +319,10 @@ thread_park (int64_t start, int64_t ticks) {
 	
 	t = thread_current ();
 	t->parked = start + ticks;
-	list_insert_ordered (&block_list, &t->elem, cmp_thrd_priorities, NULL);
+	list_insert_ordered (&sleep_wheel[(uint64_t) t->parked % SLEEP_WHEEL_SIZE],
+					&t->elem, cmp_thrd_parked, NULL);
+	if (t->parked < next_unpark)
+		next_unpark = t->parked;
 	thread_block ();
 
 	intr_set_level (old_level);
@@ -189,27 +336,51 @@ cmp_thrd_priorities (const struct list_elem *lhs, const struct list_elem *rhs, v
 	return left_thrd->priority > right_thrd->priority;
 }
 
-bool
-cmp_thrd_donation_priorities (const struct list_elem *lhs, const struct list_elem *rhs, void *aux UNUSED) {
-	struct thread *left_thrd = list_entry (lhs, struct thread, delem);
-	struct thread *right_thrd = list_entry (rhs, struct thread, delem);
+/* Orders parked threads by wake-up tick, and threads waking up
+   on the same tick by priority. */
+static bool
+cmp_thrd_parked (const struct list_elem *lhs, const struct list_elem *rhs, void *aux UNUSED) {
+	struct thread *left_thrd = list_entry (lhs, struct thread, elem);
+	struct thread *right_thrd = list_entry (rhs, struct thread, elem);
 
+	if (left_thrd->parked != right_thrd->parked)
+		return left_thrd->parked < right_thrd->parked;
 	return left_thrd->priority > right_thrd->priority;
 }
 
-/* Unpark threads. unparks all threads that can be unparked. */
+/* Unparks up to UNPARK_BATCH threads whose wake-up tick is at
+   or before TICKS.  Returns immediately unless the earliest
+   deadline is due. */
 void
 thread_try_unpark (int64_t ticks) {
-	struct list_elem *e;
-	for (e = list_begin (&block_list); e != list_end (&block_list);) {
-		struct thread *t = list_entry (e, struct thread, elem);
-		if (t->parked <= ticks) {
-			e = list_remove (e);
+	int64_t next = INT64_MAX;
+	int budget = UNPARK_BATCH;
+
+	if (ticks < next_unpark)
+		return;
+
+	/* Every slot is sorted, so only the expired prefix of each
+	   slot is visited, besides one look at each of the
+	   SLEEP_WHEEL_SIZE slots. */
+	for (int i = 0; i < SLEEP_WHEEL_SIZE; i++) {
+		struct list *slot = &sleep_wheel[i];
+		while (!list_empty (slot)) {
+			struct thread *t = list_entry (list_front (slot), struct thread, elem);
+			if (t->parked > ticks) {
+				if (t->parked < next)
+					next = t->parked;
+				break;
+			}
+			if (budget-- == 0) {
+				/* Out of budget: come back on the next tick. */
+				next_unpark = ticks;
+				return;
+			}
+			list_pop_front (slot);
 			thread_unblock (t);
-			continue;
 		}
-		e = list_next (e);
 	}
+	next_unpark = next;
 }
 
 /* Prints thread statistics. */
@@ -219,6 +390,35 @@ thread_print_stats (void) {
 			idle_ticks, kernel_ticks, user_ticks);
 }
 
+/* Prints the scheduling statistics of every live thread, and the
+   sum over all exited threads. */
+void
+thread_print_sched_stats (void) {
+	struct list_elem *e;
+
+	printf ("Scheduling statistics (times in us):\n");
+	for (e = list_begin (&thread_list); e != list_end (&thread_list);
+			e = list_next (e)) {
+		struct thread *t = list_entry (e, struct thread, telem);
+		sched_stats_print (t->name, t->tid, &t->stats);
+	}
+	if (exited_cnt > 0) {
+		printf ("%zu exited threads:\n", exited_cnt);
+		sched_stats_print ("(exited)", TID_ERROR, &exited_stats);
+	}
+}
+
+static void
+sched_stats_print (const char *name, tid_t tid,
+		const struct thread_sched_stats *s) {
+	printf ("  %-16s %5d: %'"PRIu64" voluntary, %'"PRIu64" involuntary switches, "
+			"run %'"PRIu64", wait %'"PRIu64", max latency %'"PRIu64"\n",
+			name, tid, s->nvcsw, s->nivcsw,
+			timer_tsc_to_us (s->run_cycles),
+			timer_tsc_to_us (s->wait_cycles),
+			timer_tsc_to_us (s->max_latency));
+}
+
 /* Creates a new kernel thread named NAME with the given initial
    PRIORITY, which executes FUNCTION passing AUX as the argument,
    and adds it to the ready queue.  Returns the thread identifier
@@ -249,42 +449,40 @@ thread_create (const char *name, int priority,
 struct thread *
 create_thread (const char *name, int priority,
 		thread_func *function, void *aux) {
-	struct thread *t, *next;
+	struct thread *t;
+	struct switch_threads_frame *sf;
 
 	ASSERT (function != NULL);
 
 	/* Allocate thread. */
-	t = palloc_get_page (PAL_ZERO);
+	t = thread_page_get ();
 	if (t == NULL)
 		return NULL;
 
 	/* Initialize thread. */
 	init_thread (t, name, priority);
 	t->tid = allocate_tid ();
-
-	/* Call the kernel_thread if it scheduled.
-	 * Note) rdi is 1st argument, and rsi is 2nd argument. */
-	t->tf.rip = (uintptr_t) kernel_thread;
-	t->tf.R.rdi = (uint64_t) function;
-	t->tf.R.rsi = (uint64_t) aux;
-	t->tf.ds = SEL_KDSEG;
-	t->tf.es = SEL_KDSEG;
-	t->tf.ss = SEL_KDSEG;
-	t->tf.cs = SEL_KCSEG;
-	t->tf.eflags = FLAG_IF;
+	tid_hash_insert (t);
+
+	/* Call the kernel_thread when it is first switched to, through
+	 * switch_entry().  The frame leaves RSP 16-byte aligned for
+	 * the call, as the ABI requires. */
+	sf = (struct switch_threads_frame *) ((uint8_t *) t + PGSIZE - 16) - 1;
+	memset (sf, 0, sizeof *sf);
+	sf->r12 = (uint64_t) function;
+	sf->r13 = (uint64_t) aux;
+	sf->r14 = (uint64_t) kernel_thread;
+	sf->rip = switch_entry;
+	t->rsp = (uintptr_t) sf;
 
 	/* BSD scheduler */
 	t->nice = thread_get_nice ();					/* Inherits nice. */
 	t->recent_cpu = thread_current ()->recent_cpu;	/* Inherits recent CPU. */
+	t->decay_epoch = thread_current ()->decay_epoch;
 
 	/* Add to run queue. */
 	thread_unblock (t);
-
-	list_sort (&ready_list, cmp_thrd_priorities, NULL);
-	if (!list_empty (&ready_list)) {
-		next = list_entry (list_front (&ready_list), struct thread, elem);
-		thread_yield_if (thread_current ()->priority < next->priority);
-	}
+	thread_yield_priority ();
 
 	return t;	
 }
@@ -318,7 +516,13 @@ thread_unblock (struct thread *t) {
 
 	old_level = intr_disable ();
 	ASSERT (t->status == THREAD_BLOCKED);
-	list_insert_ordered (&ready_list, &t->elem, cmp_thrd_priorities, NULL);
+	t->stats.wakeup = rdtsc ();
+	if (thread_mlfqs && t->decay_epoch != decay_epoch) {
+		/* T missed some decays while it was blocked. */
+		thread_update_recent_cpu (t);
+		thread_update_priority (t);
+	}
+	ready_push (t);
 	t->status = THREAD_READY;
 	intr_set_level (old_level);
 }
@@ -374,39 +578,55 @@ thread_exit (void) {
    may be scheduled again immediately at the scheduler's whim. */
 void
 thread_yield (void) {
-	struct thread *curr = thread_current ();
-	enum intr_level old_level;
-
-	ASSERT (!intr_context ());
+	yield (false);
+}
 
-	old_level = intr_disable ();
-	if (curr != idle_thread)
-		list_insert_ordered (&ready_list, &curr->elem, cmp_thrd_priorities, NULL);
-	do_schedule (THREAD_READY);
-	intr_set_level (old_level);
+/* Like thread_yield(), but counts the switch as involuntary in
+   the scheduling statistics.  Called when the running thread is
+   preempted: on return from an interrupt that asked for it, or
+   when a thread of higher priority becomes ready. */
+void
+thread_preempt (void) {
+	yield (true);
 }
 
-/* Yields the CPU when predicate is true. */
+/* Preempts the running thread when PREDICATE is true. */
 bool
 thread_yield_if (bool predicate) {
 	if (predicate) {
-		thread_yield ();
+		thread_preempt ();
 		return true;
 	}
 
 	return false;
 }
 
+/* Yields the CPU when a ready thread has a higher priority than
+   the running thread. */
 bool
 thread_yield_priority (void) {
-	struct thread *next;
-	
-	if (!list_empty (&ready_list)) {
-		next = list_entry (list_front (&ready_list), struct thread, elem);
-		return thread_yield_if (!intr_context () && thread_current ()->priority < next->priority);
-	}
+	return thread_yield_if (!intr_context ()
+			&& thread_current ()->priority < ready_max_priority ());
+}
 
-	return false;
+/* Sets T's effective priority to PRIORITY.  If T is waiting in
+   a run queue, it is moved to the tail of the queue for its new
+   priority. */
+void
+thread_change_priority (struct thread *t, int priority) {
+	enum intr_level old_level;
+
+	ASSERT (is_thread (t));
+	ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
+
+	old_level = intr_disable ();
+	if (t->status == THREAD_READY)
+		rq_requeue (t, priority);
+	else
+		t->priority = priority;
+	if (t->wq_elem.q != NULL)
+		waitq_update (t);
+	intr_set_level (old_level);
 }
 
 /* Sets the current thread's priority to NEW_PRIORITY. */
@@ -427,13 +647,8 @@ thread_set_priority (int new_priority) {
 	curr->priority = new_priority;
 	curr->prev_priority = new_priority;
 
-	if (!list_empty (&curr->donations)) {
-		max_priority = list_entry (list_begin (&curr->donations),
-						struct thread, delem)->priority;
-		if (curr->priority < max_priority) {
-			curr->priority = max_priority;
-		}
-	}
+	if (curr->held != NULL && curr->priority < curr->held->priority)
+		curr->priority = curr->held->priority;
 	
 	thread_yield_if (max_priority > new_priority);
 	intr_set_level (old_level);
@@ -469,16 +684,39 @@ thread_get_recent_cpu (void) {
 	return ret;
 }
 
-/* Updates recent CPU time. */
+/* Updates recent CPU time by applying every decay THRD has
+   missed since it was last updated.  Whole groups of decays are
+   applied in one step, so this takes at most
+   DECAY_HISTORY / DECAY_GROUP + 2 * DECAY_GROUP steps. */
 void thread_update_recent_cpu (struct thread* thrd) {
-	if (thrd == idle_thread) {
+	enum intr_level old_level = intr_disable ();
+	int64_t epoch = thrd->decay_epoch;
+
+	if (is_idle (thrd)) {
+		thrd->decay_epoch = decay_epoch;
+		intr_set_level (old_level);
 		return;
 	}
-	
-	enum intr_level old_level = intr_disable ();
-	fixed decay = get_decay ();
-	fixed f = multff (decay, thrd->recent_cpu);
-	thrd->recent_cpu = addfi (f, thrd->nice);
+
+	if (decay_epoch - epoch > DECAY_HISTORY) {
+		epoch = decay_epoch - DECAY_HISTORY;
+	}
+
+	while (epoch < decay_epoch) {
+		if (epoch % DECAY_GROUP == 0 && decay_epoch - epoch >= DECAY_GROUP) {
+			struct decay_group *g =
+				&decay_groups[epoch / DECAY_GROUP % DECAY_GROUP_CNT];
+			thrd->recent_cpu = addff (multff (g->a, thrd->recent_cpu),
+					multfi (g->b, thrd->nice));
+			epoch += DECAY_GROUP;
+		} else {
+			fixed f = multff (decay_history[epoch % DECAY_HISTORY],
+					thrd->recent_cpu);
+			thrd->recent_cpu = addfi (f, thrd->nice);
+			epoch++;
+		}
+	}
+	thrd->decay_epoch = decay_epoch;
 	intr_set_level (old_level);
 }
 
@@ -491,9 +729,9 @@ thread_get_load_avg (void) {
 /* Updates load average. */
 void thread_update_load_avg (void) {
 	enum intr_level old_level = intr_disable ();
-	struct thread *curr = thread_current ();
-	int ready_threads = list_size (&ready_list);
-	ready_threads = (curr == idle_thread) ? ready_threads : ready_threads + 1;
+	int ready_threads = ready_cnt;
+	if (running_thread () != idle_thread)
+		ready_threads++;
 	fixed load_factor = divfi (itofx (59), 60);
 	fixed ready_factor = divfi (itofx (1), 60);
 	load_avg = addff (multff (load_factor, load_avg), 
@@ -503,11 +741,24 @@ void thread_update_load_avg (void) {
 
 /* Updates priority. */
 void thread_update_priority (struct thread* thrd) {
-	enum intr_level old_level = intr_disable ();
-	thrd->priority = PRI_MAX 
-					- fxtoin (divfi (thrd->recent_cpu, 4)) 
+	if (is_idle (thrd)) {
+		return;
+	}
+	thread_change_priority (thrd, mlfqs_priority (thrd));
+}
+
+/* Returns the priority the BSD scheduler assigns to THRD. */
+static int
+mlfqs_priority (const struct thread *thrd) {
+	int priority = PRI_MAX
+					- fxtoin (divfi (thrd->recent_cpu, 4))
 					- (2 * thrd->nice);
-	intr_set_level (old_level);
+
+	if (priority < PRI_MIN)
+		priority = PRI_MIN;
+	if (priority > PRI_MAX)
+		priority = PRI_MAX;
+	return priority;
 }
 
 /* Returns decay value. */
@@ -519,58 +770,109 @@ fixed get_decay(void)
 			);
 }
 
-/* Updates all threads' priority */
+/* Starts a new decay period.  Called once per second, after the
+   load average has been updated.
+
+   Only the running threads are brought up to date here.  Threads
+   in the run queues catch up when they are picked to run or
+   reached by decay_ready(), blocked threads in thread_unblock(). */
 void
-thread_update_priority_all (void) {
-	struct list_elem *e = list_begin (&thread_list);
-	for (; e != list_end (&thread_list); e = list_next (e)) {
-		struct thread *thrd = list_entry (e, struct thread, telem);
-		thread_update_priority (thrd);
+thread_decay_recent_cpu (void) {
+	fixed d = get_decay ();
+	struct decay_group *g;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	g = &decay_groups[decay_epoch / DECAY_GROUP % DECAY_GROUP_CNT];
+	if (decay_epoch % DECAY_GROUP == 0) {
+		g->a = itofx (1);
+		g->b = 0;
 	}
+	g->a = multff (d, g->a);
+	g->b = addfi (multff (d, g->b), 1);
+	decay_history[decay_epoch % DECAY_HISTORY] = d;
+	decay_epoch++;
 
-	list_sort (&ready_list, cmp_thrd_priorities, NULL);
+	thread_update_recent_cpu (running_thread ());
+	thread_update_priority (running_thread ());
 }
 
-/* Updates all threads' recent_cpu */
-void
-thread_update_recent_cpu_all (void) {
-	struct list_elem *e = list_begin (&thread_list);
-	for (; e != list_end (&thread_list); e = list_next (e)) {
-		struct thread *thrd = list_entry (e, struct thread, telem);
-		thread_update_recent_cpu (thrd);
+/* Brings up to DECAY_BATCH threads in the run queue that missed
+   a decay up to date, starting from the lowest priority, whose
+   threads gain the most from the decay.  Called every tick, so
+   that a thread waiting behind higher priorities still ages.
+
+   An updated thread moves to the tail of its queue, and threads
+   joining a queue are already up to date, so the stale threads
+   of each queue are at its front. */
+static void
+decay_ready (void) {
+	uint64_t queues = ready_bitmap;
+	int cnt = 0;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	while (queues != 0 && cnt < DECAY_BATCH) {
+		int p = __builtin_ctzll (queues);
+		struct thread *t;
+
+		t = list_entry (list_front (&ready_queues[p]), struct thread, elem);
+		if (t->decay_epoch == decay_epoch) {
+			queues &= queues - 1;
+			continue;
+		}
+		thread_update_recent_cpu (t);
+		rq_requeue_tail (t, mlfqs_priority (t));
+		cnt++;
 	}
 }
 
 /* Increases recent_cpu value. */
 void
 thread_increase_recent_cpu (struct thread* thrd) {
-	if (thrd == idle_thread) {
+	if (is_idle (thrd)) {
 		return;
 	}
 	thrd->recent_cpu = addfi (thrd->recent_cpu, 1);
 }
 
+/* Returns the thread with TID, or a null pointer if there is
+   no such thread. */
 struct thread *
 thread_find (tid_t tid) {
-	struct list_elem *e = list_begin (&thread_list);
-	for (; e != list_end (&thread_list); e = list_next (e)) {
-		struct thread *t = list_entry (e, struct thread, telem);
-		if (t != NULL && t->tid == tid) {
-			return t;
+	struct list *bucket = &tid_hash[(unsigned) tid % TID_HASH_SIZE];
+	struct thread *found = NULL;
+	enum intr_level old_level = intr_disable ();
+
+	struct list_elem *e = list_begin (bucket);
+	for (; e != list_end (bucket); e = list_next (e)) {
+		struct thread *t = list_entry (e, struct thread, hash_elem);
+		if (t->tid == tid) {
+			found = t;
+			break;
 		}
 	}
+	intr_set_level (old_level);
 
-	return NULL;
+	return found;
+}
+
+/* Adds T, whose tid has just been allocated, to tid_hash. */
+static void
+tid_hash_insert (struct thread *t) {
+	enum intr_level old_level = intr_disable ();
+	list_push_back (&tid_hash[(unsigned) t->tid % TID_HASH_SIZE], &t->hash_elem);
+	intr_set_level (old_level);
 }
 /* Idle thread.  Executes when no other thread is ready to run.
 
    The idle thread is initially put on the ready list by
    thread_start().  It will be scheduled once initially, at which
-   point it initializes idle_thread, "up"s the semaphore passed
-   to it to enable thread_start() to continue, and immediately
-   blocks.  After that, the idle thread never appears in the
-   ready list.  It is returned by next_thread_to_run() as a
-   special case when the ready list is empty. */
+   point it initializes idle_thread, "up"s the semaphore
+   passed to it to enable thread_start() to continue, and
+   immediately blocks.  After that, the idle thread never appears
+   in the ready list.  It is returned by next_thread_to_run() as a
+   special case when there is nothing to run. */
 static void
 idle (void *idle_started_ UNUSED) {
 	struct semaphore *idle_started = idle_started_;
@@ -583,19 +885,108 @@ idle (void *idle_started_ UNUSED) {
 		intr_disable ();
 		thread_block ();
 
-		/* Re-enable interrupts and wait for the next one.
+		/* The wait ends here, or in schedule() if the interrupt
+		   that ends it switches to another thread right away. */
+		idle_start = rdtsc ();
+		idle_wait ();
+		intr_disable ();
+		idle_end ();
+	}
+}
+
+/* Waits, with interrupts off on entry and on on return, until
+   there may be something to run, in the way thread_idle_mode
+   says. */
+static void
+idle_wait (void) {
+	switch (thread_idle_mode) {
+		case IDLE_HLT:
+			/* Re-enable interrupts and wait for the next one.
+
+			   The `sti' instruction disables interrupts until the
+			   completion of the next instruction, so these two
+			   instructions are executed atomically.  This atomicity
+			   is important; otherwise, an interrupt could be handled
+			   between re-enabling interrupts and waiting for the next
+			   one to occur, wasting as much as one clock tick worth
+			   of time.
+
+			   See [IA32-v2a] "HLT", [IA32-v2b] "STI", and [IA32-v3a]
+			   7.11.1 "HLT Instruction". */
+			asm volatile ("sti; hlt" : : : "memory");
+			break;
+
+		case IDLE_MWAIT:
+			/* Arm the monitor on the run queue bitmap, which
+			   ready_push() writes whenever a thread is queued,
+			   then wait as for HLT.  Checking the bitmap after
+			   MONITOR closes the race with a thread queued just
+			   before.  The kernel runs on one CPU, so threads are
+			   only queued here by interrupt handlers and this
+			   behaves like HLT; a store from another processor
+			   would end the wait without an interrupt.
+
+			   See [IA32-v2b] "MONITOR" and "MWAIT". */
+			asm volatile ("monitor" : : "a" (&ready_bitmap), "c" (0), "d" (0));
+			if (ready_bitmap == 0)
+				asm volatile ("sti; mwait" : : "a" (0), "c" (0) : "memory");
+			else
+				intr_enable ();
+			break;
+
+		case IDLE_POLL:
+			/* Spin with interrupts on.  Burns the CPU but picks up
+			   new work within a few cycles. */
+			intr_enable ();
+			while (ready_bitmap == 0)
+				asm volatile ("pause" : : : "memory");
+			break;
+	}
+}
+
+/* Ends the current idle wait, if any, and records it in the
+   residency histogram.  Interrupts must be off. */
+static void
+idle_end (void) {
+	uint64_t cycles, us;
+	int bucket;
+
+	ASSERT (intr_get_level () == INTR_OFF);
 
-		   The `sti' instruction disables interrupts until the
-		   completion of the next instruction, so these two
-		   instructions are executed atomically.  This atomicity is
-		   important; otherwise, an interrupt could be handled
-		   between re-enabling interrupts and waiting for the next
-		   one to occur, wasting as much as one clock tick worth of
-		   time.
+	if (idle_start == 0)
+		return;
+	cycles = rdtsc () - idle_start;
+	idle_start = 0;
+
+	us = timer_tsc_to_us (cycles);
+	bucket = us != 0 ? 64 - __builtin_clzll (us) : 0;
+	if (bucket >= IDLE_HIST_CNT)
+		bucket = IDLE_HIST_CNT - 1;
+	idle_hist[bucket]++;
+	idle_cycles += cycles;
+}
 
-		   See [IA32-v2a] "HLT", [IA32-v2b] "STI", and [IA32-v3a]
-		   7.11.1 "HLT Instruction". */
-		asm volatile ("sti; hlt" : : : "memory");
+/* Prints the idle residency histogram. */
+void
+thread_print_idle_stats (void) {
+	static const char *mode_names[] = { "hlt", "mwait", "poll" };
+	long long waits = 0;
+
+	for (int b = 0; b < IDLE_HIST_CNT; b++)
+		waits += idle_hist[b];
+	printf ("Idle residency (%s): %lld waits, %'"PRIu64" us idle\n",
+			mode_names[thread_idle_mode], waits, timer_tsc_to_us (idle_cycles));
+
+	for (int b = 0; b < IDLE_HIST_CNT; b++) {
+		long long cnt = idle_hist[b];
+		if (cnt == 0)
+			continue;
+		if (b == 0)
+			printf ("  %18s: %lld\n", "< 1 us", cnt);
+		else if (b == IDLE_HIST_CNT - 1)
+			printf ("  >= %'12d us: %lld\n", 1 << (b - 1), cnt);
+		else
+			printf ("  %'7d-%'7d us: %lld\n", 1 << (b - 1), (1 << b) - 1, cnt);
 	}
 }
 
@@ -621,12 +1012,10 @@ init_thread (struct thread *t, const char *name, int priority) {
 	memset (t, 0, sizeof *t);
 	t->status = THREAD_BLOCKED;
 	strlcpy (t->name, name, sizeof t->name);
-	t->tf.rsp = (uint64_t) t + PGSIZE - sizeof (void *);
 	t->priority = priority;
 	t->prev_priority = priority;
 	t->nice = 0;
 	t->recent_cpu = 0;
-	list_init (&t->donations);
 	
 	/* Add to thread list. */
 	list_push_back (&thread_list, &t->telem);
@@ -641,11 +1030,92 @@ init_thread (struct thread *t, const char *name, int priority) {
    idle_thread. */
 static struct thread *
 next_thread_to_run (void) {
-	if (list_empty (&ready_list))
-		return idle_thread;
-	else
-		return list_entry (list_pop_front (&ready_list), 
-							struct thread, elem);
+	struct thread *next;
+
+	for (;;) {
+		int priority;
+
+		if (ready_bitmap == 0)
+			return idle_thread;
+		next = list_entry (list_front (&ready_queues[bsrq (ready_bitmap)]),
+						struct thread, elem);
+		if (!thread_mlfqs || next->decay_epoch == decay_epoch)
+			break;
+
+		/* NEXT missed a decay while it waited.  If that lowers
+		   its priority, it goes behind the threads it now ranks
+		   under. */
+		thread_update_recent_cpu (next);
+		priority = mlfqs_priority (next);
+		if (priority >= next->priority) {
+			rq_requeue (next, priority);
+			break;
+		}
+		rq_requeue_tail (next, priority);
+	}
+	rq_erase (next);
+	return next;
+}
+
+/* Appends T to the run queue for its priority.  Interrupts must
+   be off. */
+static void
+ready_push (struct thread *t) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	t->stats.ready_start = rdtsc ();
+	rq_insert (t);
+}
+
+/* Returns the highest priority in the run queue, or PRI_MIN - 1
+   if it is empty. */
+static int
+ready_max_priority (void) {
+	return ready_bitmap != 0 ? (int) bsrq (ready_bitmap) : PRI_MIN - 1;
+}
+
+/* Appends T to the run queue for its priority.  Interrupts must
+   be off. */
+static void
+rq_insert (struct thread *t) {
+	ASSERT (intr_get_level () == INTR_OFF);
+	ASSERT (PRI_MIN <= t->priority && t->priority <= PRI_MAX);
+
+	list_push_back (&ready_queues[t->priority], &t->elem);
+	ready_bitmap |= 1ULL << t->priority;
+	ready_cnt++;
+}
+
+/* Removes T from the run queue.  Interrupts must be off. */
+static void
+rq_erase (struct thread *t) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	list_remove (&t->elem);
+	if (list_empty (&ready_queues[t->priority]))
+		ready_bitmap &= ~(1ULL << t->priority);
+	ready_cnt--;
+}
+
+/* Moves T, which waits in the run queue, to the tail of the queue
+   for PRIORITY.  Does nothing if T already has that priority.
+   Interrupts must be off. */
+static void
+rq_requeue (struct thread *t, int priority) {
+	if (t->priority == priority)
+		return;
+	rq_erase (t);
+	t->priority = priority;
+	rq_insert (t);
+}
+
+/* Moves T, which waits in the run queue, to the tail of the queue
+   for PRIORITY, even if it already has that priority. */
+static void
+rq_requeue_tail (struct thread *t, int priority) {
+	rq_erase (t);
+	t->priority = priority;
+	rq_insert (t);
 }
 
 /* Use iretq to launch the thread */
@@ -676,73 +1146,38 @@ do_iret (struct intr_frame *tf) {
 			: : "g" ((uint64_t) tf) : "memory");
 }
 
-/* Switching the thread by activating the new thread's page
-   tables, and, if the previous thread is dying, destroying it.
-
-   At this function's invocation, we just switched from thread
-   PREV, the new thread is already running, and interrupts are
-   still disabled.
+/* Switches from the running thread to TH by saving the running
+   thread's callee-saved registers and stack pointer and restoring
+   those of TH.  This is only ever a switch between two kernel
+   contexts: a thread in user mode has entered the kernel through
+   an interrupt or a system call, which saved its user context on
+   its kernel stack.  do_iret() is used only to enter user mode.
 
-   It's not safe to call printf() until the thread switch is
-   complete.  In practice that means that printf()s should be
-   added at the end of the function. */
+   At this function's invocation, interrupts must be disabled.
+   It returns when some other thread switches back to us. */
 static void
 thread_launch (struct thread *th) {
-	uint64_t tf_cur = (uint64_t) &running_thread ()->tf;
-	uint64_t tf = (uint64_t) &th->tf;
 	ASSERT (intr_get_level () == INTR_OFF);
 
-	/* The main switching logic.
-	 * We first restore the whole execution context into the intr_frame
-	 * and then switching to the next thread by calling do_iret.
-	 * Note that, we SHOULD NOT use any stack from here
-	 * until switching is done. */
-	__asm __volatile (
-			/* Store registers that will be used. */
-			"push %%rax\n"
-			"push %%rbx\n"
-			"push %%rcx\n"
-			/* Fetch input once */
-			"movq %0, %%rax\n"
-			"movq %1, %%rcx\n"
-			"movq %%r15, 0(%%rax)\n"
-			"movq %%r14, 8(%%rax)\n"
-			"movq %%r13, 16(%%rax)\n"
-			"movq %%r12, 24(%%rax)\n"
-			"movq %%r11, 32(%%rax)\n"
-			"movq %%r10, 40(%%rax)\n"
-			"movq %%r9, 48(%%rax)\n"
-			"movq %%r8, 56(%%rax)\n"
-			"movq %%rsi, 64(%%rax)\n"
-			"movq %%rdi, 72(%%rax)\n"
-			"movq %%rbp, 80(%%rax)\n"
-			"movq %%rdx, 88(%%rax)\n"
-			"pop %%rbx\n"              // Saved rcx
-			"movq %%rbx, 96(%%rax)\n"
-			"pop %%rbx\n"              // Saved rbx
-			"movq %%rbx, 104(%%rax)\n"
-			"pop %%rbx\n"              // Saved rax
-			"movq %%rbx, 112(%%rax)\n"
-			"addq $120, %%rax\n"
-			"movw %%es, (%%rax)\n"
-			"movw %%ds, 8(%%rax)\n"
-			"addq $32, %%rax\n"
-			"call __next\n"         // read the current rip.
-			"__next:\n"
-			"pop %%rbx\n"
-			"addq $(out_iret -  __next), %%rbx\n"
-			"movq %%rbx, 0(%%rax)\n" // rip
-			"movw %%cs, 8(%%rax)\n"  // cs
-			"pushfq\n"
-			"popq %%rbx\n"
-			"mov %%rbx, 16(%%rax)\n" // eflags
-			"mov %%rsp, 24(%%rax)\n" // rsp
-			"movw %%ss, 32(%%rax)\n"
-			"mov %%rcx, %%rdi\n"
-			"call do_iret\n"
-			"out_iret:\n"
-			: : "g"(tf_cur), "g" (tf) : "memory"
-			);
+	switch_threads (&running_thread ()->rsp, th->rsp);
+}
+
+/* Puts the running thread back in the run queue and schedules.
+   PREEMPTED tells whether the thread gives up the CPU on its own
+   or is being preempted. */
+static void
+yield (bool preempted) {
+	struct thread *curr = thread_current ();
+	enum intr_level old_level;
+
+	ASSERT (!intr_context ());
+
+	old_level = intr_disable ();
+	if (!is_idle (curr))
+		ready_push (curr);
+	curr->stats.preempted = preempted;
+	do_schedule (THREAD_READY);
+	intr_set_level (old_level);
 }
 
 /* Schedules a new process. At entry, interrupts must be off.
@@ -755,9 +1190,18 @@ do_schedule(int status) {
 	ASSERT (thread_current()->status == THREAD_RUNNING);
 	while (!list_empty (&destruction_req)) {
 		struct thread *victim =
-			list_entry (list_pop_front (&destruction_req), struct thread, elem);
+			list_entry (list_pop_front (&destruction_req),
+					struct thread, elem);
 		list_remove (&victim->telem);
-		palloc_free_page(victim);
+		list_remove (&victim->hash_elem);
+		exited_stats.nvcsw += victim->stats.nvcsw;
+		exited_stats.nivcsw += victim->stats.nivcsw;
+		exited_stats.run_cycles += victim->stats.run_cycles;
+		exited_stats.wait_cycles += victim->stats.wait_cycles;
+		if (victim->stats.max_latency > exited_stats.max_latency)
+			exited_stats.max_latency = victim->stats.max_latency;
+		exited_cnt++;
+		thread_page_put (victim);
 	}
 	thread_current ()->status = status;
 	schedule ();
@@ -771,11 +1215,17 @@ schedule (void) {
 	ASSERT (intr_get_level () == INTR_OFF);
 	ASSERT (curr->status != THREAD_RUNNING);
 	ASSERT (is_thread (next));
+	sched_stats_switch (curr, next);
+	if (curr == idle_thread)
+		idle_end ();
+	timer_sync ();
+
 	/* Mark us as running. */
 	next->status = THREAD_RUNNING;
 
 	/* Start new time slice. */
 	thread_ticks = 0;
+	timer_reprogram ();
 
 #ifdef USERPROG
 	/* Activate the new address space. */
@@ -801,15 +1251,101 @@ schedule (void) {
 	}
 }
 
+/* Accounts a switch from CURR to NEXT in their scheduling
+   statistics.  CURR has already been given its new status.  A
+   switch away from a thread that is still runnable counts as
+   involuntary, one away from a blocking or dying thread as
+   voluntary. */
+static void
+sched_stats_switch (struct thread *curr, struct thread *next) {
+	uint64_t now = rdtsc ();
+
+	curr->stats.run_cycles += now - curr->stats.run_start;
+	if (curr != next) {
+		if (curr->stats.preempted)
+			curr->stats.nivcsw++;
+		else
+			curr->stats.nvcsw++;
+	}
+	curr->stats.preempted = false;
+
+	if (!is_idle (next) && next->status == THREAD_READY) {
+		next->stats.wait_cycles += now - next->stats.ready_start;
+		if (next->stats.wakeup != 0) {
+			if (now - next->stats.wakeup > next->stats.max_latency)
+				next->stats.max_latency = now - next->stats.wakeup;
+			next->stats.wakeup = 0;
+		}
+	}
+	next->stats.run_start = now;
+}
+
+/* Returns a page for a new thread, recycling one of an exited
+   thread if one is cached.  The page is not zeroed: init_thread()
+   clears struct thread, and the stack needs no initialization. */
+static struct thread *
+thread_page_get (void) {
+	struct thread *t = NULL;
+	enum intr_level old_level;
+
+	old_level = intr_disable ();
+	if (!list_empty (&thread_cache)) {
+		t = list_entry (list_pop_front (&thread_cache), struct thread, elem);
+		thread_cache_cnt--;
+	}
+	intr_set_level (old_level);
+
+	return t != NULL ? t : palloc_get_page (0);
+}
+
+/* Releases the page of exited thread T, keeping it in
+   thread_cache unless the cache is full.  Interrupts must be
+   off. */
+static void
+thread_page_put (struct thread *t) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	t->magic = 0;
+	if (thread_cache_cnt < THREAD_CACHE_MAX) {
+		list_push_front (&thread_cache, &t->elem);
+		thread_cache_cnt++;
+	} else
+		palloc_free_page (t);
+}
+
+/* Returns every cached thread page to palloc.  Called by palloc
+   when the kernel pool runs out.  Returns the number of pages
+   freed. */
+size_t
+thread_cache_shrink (void) {
+	size_t cnt = 0;
+
+	for (;;) {
+		struct thread *t = NULL;
+		enum intr_level old_level = intr_disable ();
+		if (!list_empty (&thread_cache)) {
+			t = list_entry (list_pop_front (&thread_cache), struct thread, elem);
+			thread_cache_cnt--;
+		}
+		intr_set_level (old_level);
+
+		if (t == NULL)
+			break;
+		palloc_free_page (t);
+		cnt++;
+	}
+	return cnt;
+}
+
 /* Returns a tid to use for a new thread. */
 static tid_t
 allocate_tid (void) {
 	static tid_t next_tid = 1;
 	tid_t tid;
 
-	lock_acquire (&tid_lock);
+	mutex_lock (&tid_lock);
 	tid = next_tid++;
-	lock_release (&tid_lock);
+	mutex_unlock (&tid_lock);
 
 	return tid;
 }
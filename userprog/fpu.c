@@ -0,0 +1,229 @@
+#include "userprog/fpu.h"
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "userprog/gdt.h"
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+/* Lazy FPU/SSE context switching.
+
+   The kernel itself is built with -msoft-float -mno-sse and never
+   touches the FPU, so only user programs have FPU state.  Saving
+   and restoring it on every context switch would be wasted work
+   for the many threads that never use it, so it is switched
+   lazily instead:
+
+     - fpu_owner remembers the thread whose state is currently
+       loaded in the FPU registers.
+
+     - On a context switch, CR0.TS is set unless the next thread
+       is the owner.  While TS is set, the first FPU or SSE
+       instruction raises #NM (Device Not Available).
+
+     - The #NM handler clears TS, saves the owner's registers to
+       the owner's save area and loads the current thread's.
+
+   A thread's save area is allocated on its first #NM.  XSAVE is
+   used if the CPU supports it, FXSAVE otherwise.  See [IA32-v1]
+   chapter 13 "Managing State Using the XSAVE Feature Set". */
+
+/* CR0 and CR4 bits. */
+#define CR0_MP (1 << 1)         /* Monitor coprocessor. */
+#define CR0_EM (1 << 2)         /* FPU emulation. */
+#define CR0_TS (1 << 3)         /* Task switched. */
+#define CR0_NE (1 << 5)         /* Native FPU error reporting. */
+#define CR4_OSFXSR (1 << 9)     /* FXSAVE/FXRSTOR and SSE. */
+#define CR4_OSXMMEXCPT (1 << 10) /* Unmasked SSE exceptions. */
+#define CR4_OSXSAVE (1 << 18)   /* XSAVE and XCR0. */
+
+/* CPUID.1:ECX bits. */
+#define CPUID_XSAVE (1 << 26)
+
+/* XCR0 state components. */
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+/* Default MXCSR: all SIMD exceptions masked, round to nearest. */
+#define MXCSR_DEFAULT 0x1f80
+
+static bool use_xsave;          /* XSAVE available? */
+static struct thread *fpu_owner; /* Whose state is in the FPU. */
+static size_t fpu_size;         /* Size of a save area in bytes. */
+
+/* State loaded into a thread's FPU on its first use. */
+static uint8_t fpu_init_state[PGSIZE] __attribute__ ((aligned (64)));
+
+/* Statistics. */
+static long long fpu_trap_cnt;  /* # of #NM traps. */
+static long long fpu_save_cnt;  /* # of states saved for another thread. */
+
+static void fpu_trap (struct intr_frame *);
+
+static void
+fpu_save (void *area) {
+	if (use_xsave)
+		asm volatile ("xsave64 (%0)"
+				: : "r" (area), "a" (-1), "d" (-1) : "memory");
+	else
+		asm volatile ("fxsave64 (%0)" : : "r" (area) : "memory");
+}
+
+static void
+fpu_restore (const void *area) {
+	if (use_xsave)
+		asm volatile ("xrstor64 (%0)"
+				: : "r" (area), "a" (-1), "d" (-1) : "memory");
+	else
+		asm volatile ("fxrstor64 (%0)" : : "r" (area) : "memory");
+}
+
+static void
+stts (void) {
+	lcr0 (rcr0 () | CR0_TS);
+}
+
+/* Enables the FPU and SSE for user programs, records the initial
+   FPU state, and registers the #NM handler. */
+void
+fpu_init (void) {
+	uint32_t eax, ebx, ecx, edx;
+	uint32_t mxcsr = MXCSR_DEFAULT;
+
+	lcr0 ((rcr0 () & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+	lcr4 (rcr4 () | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+	cpuid (1, 0, &eax, &ebx, &ecx, &edx);
+	use_xsave = (ecx & CPUID_XSAVE) != 0;
+	if (use_xsave) {
+		uint64_t xcr0;
+
+		lcr4 (rcr4 () | CR4_OSXSAVE);
+		cpuid (0xd, 0, &eax, &ebx, &ecx, &edx);
+		xcr0 = eax & (XCR0_X87 | XCR0_SSE | XCR0_AVX);
+		asm volatile ("xsetbv"
+				: : "c" (0), "a" ((uint32_t) xcr0), "d" ((uint32_t) (xcr0 >> 32)));
+
+		/* EBX now reports the size needed for the enabled
+		   components. */
+		cpuid (0xd, 0, &eax, &ebx, &ecx, &edx);
+		fpu_size = ebx;
+	} else
+		fpu_size = 512;
+	ASSERT (fpu_size <= PGSIZE);
+
+	asm volatile ("fninit");
+	asm volatile ("ldmxcsr %0" : : "m" (mxcsr));
+	fpu_save (fpu_init_state);
+	stts ();
+
+	intr_register_int (7, 0, INTR_ON, fpu_trap,
+			"#NM Device Not Available Exception");
+}
+
+/* Prepares the FPU for running NEXT.  Called on every context
+   switch, with interrupts off. */
+void
+fpu_activate (struct thread *next) {
+	uint64_t cr0 = rcr0 ();
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (fpu_owner == next) {
+		if (cr0 & CR0_TS)
+			clts ();
+	} else if (!(cr0 & CR0_TS))
+		lcr0 (cr0 | CR0_TS);
+}
+
+/* #NM handler.  Gives the FPU to the current thread. */
+static void
+fpu_trap (struct intr_frame *f) {
+	struct thread *curr = thread_current ();
+	enum intr_level old_level;
+
+	/* The kernel never uses the FPU. */
+	if (f->cs != SEL_UCSEG) {
+		intr_dump_frame (f);
+		PANIC ("Kernel bug - FPU used in kernel");
+	}
+
+	if (curr->fpu == NULL) {
+		curr->fpu = palloc_get_page (0);
+		if (curr->fpu == NULL) {
+			printf ("%s: dying due to lack of memory for FPU state.\n",
+					thread_name ());
+			thread_exit ();
+		}
+		memcpy (curr->fpu, fpu_init_state, fpu_size);
+	}
+
+	old_level = intr_disable ();
+	fpu_trap_cnt++;
+	clts ();
+	if (fpu_owner != curr) {
+		if (fpu_owner != NULL) {
+			fpu_save (fpu_owner->fpu);
+			fpu_save_cnt++;
+		}
+		fpu_restore (curr->fpu);
+		fpu_owner = curr;
+	}
+	intr_set_level (old_level);
+}
+
+/* Gives DST a copy of SRC's FPU state.  Used by fork().  Returns
+   false if memory for the copy cannot be allocated. */
+bool
+fpu_copy (struct thread *dst, struct thread *src) {
+	enum intr_level old_level;
+
+	if (src->fpu == NULL)
+		return true;
+
+	dst->fpu = palloc_get_page (0);
+	if (dst->fpu == NULL)
+		return false;
+
+	/* SRC's latest state may only be in the registers. */
+	old_level = intr_disable ();
+	if (fpu_owner == src) {
+		clts ();
+		fpu_save (src->fpu);
+		fpu_activate (thread_current ());
+	}
+	intr_set_level (old_level);
+
+	memcpy (dst->fpu, src->fpu, fpu_size);
+	return true;
+}
+
+/* Frees T's FPU save area.  Called when T exits. */
+void
+fpu_release (struct thread *t) {
+	enum intr_level old_level;
+
+	if (t->fpu == NULL)
+		return;
+
+	old_level = intr_disable ();
+	if (fpu_owner == t)
+		fpu_owner = NULL;
+	fpu_activate (thread_current ());
+	intr_set_level (old_level);
+
+	palloc_free_page (t->fpu);
+	t->fpu = NULL;
+}
+
+/* Prints FPU statistics. */
+void
+fpu_print_stats (void) {
+	printf ("FPU: %lld traps, %lld state saves\n",
+			fpu_trap_cnt, fpu_save_cnt);
+}
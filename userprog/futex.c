@@ -0,0 +1,201 @@
+#include "userprog/futex.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "userprog/task.h"
+
+/* Fast user-space mutexes.
+
+   A user program keeps its lock or condition state in an int of
+   its own memory and changes it with atomic instructions, so
+   uncontended operations never enter the kernel.  Only to sleep
+   or to wake sleepers does it call futex_wait() or futex_wake()
+   with the address of that int.
+
+   A waiter is keyed by the page table it runs in and the user
+   address it waits on, so threads of one process meet on the
+   same key.  Keys hash into FUTEX_BUCKETS buckets, each with its
+   own lock and list of waiters.  futex_wait() reads the user's
+   int with its bucket's lock held, and futex_wake() takes the
+   same lock, so a wake-up that follows a change to the int
+   cannot slip in between the waiter's check and its sleep. */
+
+#define FUTEX_BUCKETS 64
+
+/* A thread sleeping in futex_wait(). */
+struct futex_waiter {
+	struct list_elem elem;      /* Element in bucket's list. */
+	uint64_t *pml4;             /* Page table of the waiter. */
+	const int *uaddr;           /* User address waited on. */
+	struct thread *thread;      /* The waiting thread. */
+	struct semaphore sema;      /* Upped to wake the thread. */
+};
+
+/* A hash bucket. */
+struct futex_bucket {
+	struct lock lock;           /* Protects waiters. */
+	struct list waiters;        /* Waiting threads. */
+};
+
+static struct futex_bucket buckets[FUTEX_BUCKETS];
+
+static bool get_user_int (const int *uaddr, int *value);
+
+static struct futex_bucket *
+bucket_of (uint64_t *pml4, const int *uaddr) {
+	const void *key[2] = { pml4, uaddr };
+	return &buckets[hash_bytes (key, sizeof key) % FUTEX_BUCKETS];
+}
+
+/* Initializes the futex buckets. */
+void
+futex_init (void) {
+	for (int i = 0; i < FUTEX_BUCKETS; i++) {
+		lock_init_named (&buckets[i].lock, "futex bucket");
+		list_init (&buckets[i].waiters);
+	}
+}
+
+/* If *UADDR equals EXPECTED, sleeps until futex_wake() is called
+   for UADDR and returns 0.  Otherwise returns -1 at once, as it
+   does for a thread that has been killed.  UADDR must be an
+   aligned user address; if it cannot be read, for instance
+   because another thread unmapped it, the process exits. */
+int
+futex_wait (const int *uaddr, int expected) {
+	struct thread *curr = thread_current ();
+	struct futex_bucket *b = bucket_of (curr->pml4, uaddr);
+	struct futex_waiter w;
+	int value;
+
+	lock_acquire (&b->lock);
+	if (curr->killed) {
+		lock_release (&b->lock);
+		return -1;
+	}
+	if (!get_user_int (uaddr, &value)) {
+		lock_release (&b->lock);
+		task_exit (-1);
+	}
+	if (value != expected) {
+		lock_release (&b->lock);
+		return -1;
+	}
+
+	w.pml4 = curr->pml4;
+	w.uaddr = uaddr;
+	w.thread = curr;
+	sema_init (&w.sema, 0);
+	list_push_back (&b->waiters, &w.elem);
+	lock_release (&b->lock);
+
+	sema_down (&w.sema);
+	return 0;
+}
+
+/* Returns true if waiter A has higher priority than waiter B. */
+static bool
+waiter_more (const struct list_elem *a_, const struct list_elem *b_,
+		void *aux UNUSED) {
+	const struct futex_waiter *a = list_entry (a_, struct futex_waiter, elem);
+	const struct futex_waiter *b = list_entry (b_, struct futex_waiter, elem);
+
+	return a->thread->priority > b->thread->priority;
+}
+
+/* Wakes up to CNT threads waiting on UADDR in the current
+   process, highest priority first, and returns how many were
+   woken.  The bucket is scanned once: the waiters on UADDR are
+   taken out, and if there are more than CNT, they are sorted by
+   priority, which keeps waiters of equal priority in arrival
+   order, and the rest are put back. */
+int
+futex_wake (const int *uaddr, int cnt) {
+	uint64_t *pml4 = thread_current ()->pml4;
+	struct futex_bucket *b = bucket_of (pml4, uaddr);
+	struct list woken;
+	int woken_cnt = 0;
+
+	list_init (&woken);
+	lock_acquire (&b->lock);
+	for (struct list_elem *e = list_begin (&b->waiters);
+			e != list_end (&b->waiters);) {
+		struct futex_waiter *w = list_entry (e, struct futex_waiter, elem);
+		e = list_next (e);
+		if (w->pml4 == pml4 && w->uaddr == uaddr) {
+			list_remove (&w->elem);
+			list_push_back (&woken, &w->elem);
+			woken_cnt++;
+		}
+	}
+	if (woken_cnt > cnt) {
+		struct list_elem *rest;
+
+		list_sort (&woken, waiter_more, NULL);
+		rest = list_begin (&woken);
+		for (int i = 0; i < cnt; i++)
+			rest = list_next (rest);
+		list_splice (list_end (&b->waiters), rest, list_end (&woken));
+		woken_cnt = cnt;
+	}
+	lock_release (&b->lock);
+
+	/* A woken waiter's record lives on its stack, so it must not
+	   be touched after its semaphore is upped. */
+	while (!list_empty (&woken)) {
+		struct futex_waiter *w = list_entry (list_pop_front (&woken),
+				struct futex_waiter, elem);
+		sema_up (&w->sema);
+	}
+	return woken_cnt;
+}
+
+/* Wakes every thread waiting in the address space of PML4, so
+   that threads killed by task_exit() get back to the point where
+   they die.  Threads killed before they wait do not sleep. */
+void
+futex_cancel (uint64_t *pml4) {
+	for (int i = 0; i < FUTEX_BUCKETS; i++) {
+		struct futex_bucket *b = &buckets[i];
+		struct list woken;
+
+		list_init (&woken);
+		lock_acquire (&b->lock);
+		for (struct list_elem *e = list_begin (&b->waiters);
+				e != list_end (&b->waiters);) {
+			struct futex_waiter *w = list_entry (e, struct futex_waiter, elem);
+			e = list_next (e);
+			if (w->pml4 == pml4) {
+				list_remove (&w->elem);
+				list_push_back (&woken, &w->elem);
+			}
+		}
+		lock_release (&b->lock);
+
+		while (!list_empty (&woken))
+			sema_up (&list_entry (list_pop_front (&woken),
+						struct futex_waiter, elem)->sema);
+	}
+}
+
+/* Reads the int at user address UADDR, which must be aligned and
+   below KERN_BASE, into *VALUE.  Returns true if successful,
+   false if a page fault occurred.  Like get_user() in syscall.c,
+   it relies on page_fault() resuming at the address in RAX and
+   setting RAX to -1; the load is zero-extended so that no int
+   value reads as -1.  An aligned 4-byte load is atomic. */
+static bool
+get_user_int (const int *uaddr, int *value) {
+	int64_t result;
+	__asm __volatile (
+	"movabsq $1f, %0\n"
+	"movl %1, %k0\n"
+	"1:\n"
+	: "=&a" (result) : "m" (*uaddr) : "memory");
+	if (result == -1)
+		return false;
+	*value = (int) result;
+	return true;
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "userprog/fpu.h"
 #include "userprog/gdt.h"
 #include "userprog/task.h"
 #include "userprog/tss.h"
@@ -18,6 +19,7 @@
 #include "threads/thread.h"
 #include "threads/malloc.h"
 #include "threads/mmu.h"
+#include "threads/slab.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 #include "intrinsic.h"
@@ -31,11 +33,23 @@ static bool load (const char *file_name, struct intr_frame *if_);
 static void initd (void *task);
 static void __do_fork (void *);
 static void build_stack (const char *file_name, struct intr_frame *if_);
+static void start_thread (void *);
+static bool setup_thread_stack (int slot);
+#ifdef VM
+static bool spt_create (struct thread *t);
+#endif
+
+/* User stacks of threads made by process_thread_create() lie
+   below the 1 MB the main thread's stack may grow into, one
+   THREAD_STACK_SIZE slot per thread.  The lowest page of each
+   slot is left unmapped to catch overflows. */
+#define THREAD_STACK_SIZE (64 * 1024)
+#define THREAD_STACK_TOP(SLOT) \
+	(USER_STACK - (1 << 20) - (uintptr_t) (SLOT) * THREAD_STACK_SIZE)
 
 /* Initialize process system. */
 void
 process_init (void) {
-	lock_init (&process_filesys_lock);
 	task_init ();
 }
 
@@ -76,9 +90,6 @@ process_create_initd (const char *file_name) {
 /* A thread function that launches first user process. */
 static void
 initd (void *task) {
-#ifdef VM
-	supplemental_page_table_init (&thread_current ()->spt);
-#endif
 	struct task *t = (struct task *) task;
 	task_set_thread (t, thread_current ());
 	if (process_exec (t->args) < 0)
@@ -104,11 +115,10 @@ process_fork (const char *name, struct intr_frame *if_ UNUSED) {
 	child = task_create (name, NULL);
 	child->parent_pid = parent->pid;
 	child->if_ = if_;
+	child->args = thread_current ();
 	child_pid = child->pid;
 
-	// lock_acquire (&process_filesys_lock);
 	child->executable = file_reopen (parent->executable);
-	// lock_release (&process_filesys_lock);
 	thread = create_thread (name, PRI_DEFAULT, __do_fork, child);
 	if (thread != NULL) {
 		sema_down (&child->fork_lock);
@@ -170,7 +180,8 @@ duplicate_pte (uint64_t *pte, void *va, void *aux) {
 #endif
 
 /* A thread function that copies parent's execution context.
- * Hint) parent->tf does not hold the userland context of the process.
+ * Hint) parent's struct thread does not hold the userland context of the
+ *       process.
  *       That is, you are required to pass second argument of process_fork to
  *       this function. */
 static void
@@ -180,6 +191,7 @@ __do_fork (void *aux) {
 	struct thread *current = thread_current ();
 	/* TODO: somehow pass the parent_if. (i.e. process_fork()'s if_) */
 	struct intr_frame *parent_if = task->if_;
+	struct thread *forker = task->args;
 	bool succ = true;
 	task_set_thread (task, current);
 	struct task *parent = task_find_by_pid (task->parent_pid);
@@ -198,8 +210,8 @@ __do_fork (void *aux) {
 
 	process_activate (current);
 #ifdef VM
-	supplemental_page_table_init (&current->spt);
-	if (!supplemental_page_table_copy (&current->spt, &parent->thread->spt)) {
+	if (!spt_create (current)
+			|| !supplemental_page_table_copy (current->spt, forker->spt)) {
 		goto error;
 	}
 #else
@@ -208,6 +220,9 @@ __do_fork (void *aux) {
 #endif
 
 	task_fork_fd (parent, task);
+	task_fork_stack (parent, task, forker);
+	if (!fpu_copy (current, forker))
+		goto error;
 
 	/* Finally, switch to the newly created process. */
 	if (succ) {
@@ -303,10 +318,25 @@ done:
 /* Exit the process. This function is called by thread_exit (). */
 void
 process_exit (void) {
+	struct thread *curr = thread_current ();
 	struct task *task = task_find_by_tid (thread_tid ());
 	if (task == NULL) {
 		goto cleanup;
 	}
+
+	/* A thread made by process_thread_create() leaves the address
+	 * space and the rest of the process to the main thread. */
+	if (task->thread != curr) {
+		fpu_release (curr);
+		curr->pml4 = NULL;
+		pml4_activate (NULL);
+#ifdef VM
+		curr->spt = NULL;
+#endif
+		task_thread_exit (task);
+		return;
+	}
+	task_reap_threads (task, false);
 	
 	/* Fork fails */
 	if (task->status == PROCESS_FAIL) {
@@ -347,8 +377,13 @@ process_cleanup (void) {
 	struct thread *curr = thread_current ();
 
 #ifdef VM
-	supplemental_page_table_kill (&curr->spt);
+	if (curr->spt != NULL) {
+		supplemental_page_table_kill (curr->spt);
+		free (curr->spt);
+		curr->spt = NULL;
+	}
 #endif
+	fpu_release (curr);
 
 	uint64_t *pml4;
 	/* Destroy the current process's page directory and switch back
@@ -377,6 +412,9 @@ process_activate (struct thread *next) {
 
 	/* Set thread's kernel stack for use in processing interrupts. */
 	tss_update (next);
+
+	/* Trap on FPU use unless NEXT's FPU state is loaded. */
+	fpu_activate (next);
 }
 
 /* We load ELF binaries.  The following definitions are taken
@@ -460,11 +498,13 @@ load (const char *file_name, struct intr_frame *if_) {
 	if (curr->pml4 == NULL)
 		goto fail;
 	process_activate (curr);
+#ifdef VM
+	if (!spt_create (curr))
+		goto fail;
+#endif
 
 	/* Open executable file. */
-	lock_acquire (&process_filesys_lock);
 	file = filesys_open (program);
-	lock_release (&process_filesys_lock);
 	if (file == NULL) {
 		printf ("load: %s: open failed\n", program);
 		goto fail;
@@ -551,9 +591,7 @@ load (const char *file_name, struct intr_frame *if_) {
 
 	return true;
 fail:
-	// lock_acquire (&process_filesys_lock);
 	file_close (file);
-	// lock_release (&process_filesys_lock);
 	return false;
 }
 
@@ -576,8 +614,11 @@ build_stack (const char *file_name, struct intr_frame *if_) {
 		argc++;
 	}
 
-	/* Align stack */
-	stack -= stack % 8;
+	/* Align stack so that RSP is 16-byte aligned once the argument
+	   pointers are pushed, as the ABI requires for SSE code. */
+	stack -= stack % 16;
+	if ((argc + 1) % 2 != 0)
+		stack -= sizeof (uintptr_t);
 
 	/* Push argument pointers. */
 	for (int j = argc; j >= 0; j--) {
@@ -595,6 +636,71 @@ build_stack (const char *file_name, struct intr_frame *if_) {
 	if_->rsp = stack;
 }
 
+/* Starts a new thread in the current process, running user
+ * code at ENTRY with ARG0 and ARG1 as its first two arguments on
+ * a stack of its own.  The thread shares the process's address
+ * space and file descriptors.  Returns the new thread's ID, or
+ * TID_ERROR if it cannot be created. */
+tid_t
+process_thread_create (void *entry, void *arg0, void *arg1) {
+	struct thread *curr = thread_current ();
+	struct task_thread *tt;
+
+	if (curr->task == NULL)
+		return TID_ERROR;
+
+	tt = task_thread_add (curr->task);
+	if (tt == NULL)
+		return TID_ERROR;
+
+	tt->entry = entry;
+	tt->args[0] = arg0;
+	tt->args[1] = arg1;
+	if (!setup_thread_stack (tt->slot)
+			|| create_thread (curr->task->name, curr->priority,
+				start_thread, tt) == NULL) {
+		task_thread_discard (tt);
+		return TID_ERROR;
+	}
+
+	sema_down (&tt->started);
+	return tt->tid;
+}
+
+/* A thread function that enters user code for a thread made by
+ * process_thread_create(). */
+static void
+start_thread (void *tt_) {
+	struct task_thread *tt = tt_;
+	struct thread *curr = thread_current ();
+	struct thread *leader = tt->task->thread;
+	struct intr_frame if_;
+
+	memset (&if_, 0, sizeof if_);
+	if_.ds = if_.es = if_.ss = SEL_UDSEG;
+	if_.cs = SEL_UCSEG;
+	if_.eflags = FLAG_IF | FLAG_MBS;
+	if_.rip = (uintptr_t) tt->entry;
+	if_.R.rdi = (uint64_t) tt->args[0];
+	if_.R.rsi = (uint64_t) tt->args[1];
+	/* As if ENTRY had been called, RSP is 8 past 16-byte
+	 * alignment.  ENTRY must not return. */
+	if_.rsp = THREAD_STACK_TOP (tt->slot) - sizeof (uintptr_t);
+
+	curr->pml4 = leader->pml4;
+#ifdef VM
+	curr->spt = leader->spt;
+#endif
+	process_activate (curr);
+
+	/* TT may be freed once the thread is started. */
+	task_thread_start (tt);
+	if (curr->killed)
+		thread_exit ();
+	do_iret (&if_);
+	NOT_REACHED ();
+}
+
 /* Checks whether PHDR describes a valid, loadable segment in
  * FILE and returns true if so, false otherwise. */
 static bool
@@ -720,6 +826,30 @@ setup_stack (struct intr_frame *if_) {
 	return success;
 }
 
+/* Maps the user stack for thread stack slot SLOT, unless an
+ * earlier thread in the slot already did. */
+static bool
+setup_thread_stack (int slot) {
+	uint8_t *top = (uint8_t *) THREAD_STACK_TOP (slot);
+	uint8_t *upage;
+
+	for (upage = top - PGSIZE; upage > top - THREAD_STACK_SIZE;
+			upage -= PGSIZE) {
+		uint8_t *kpage;
+
+		if (pml4_get_page (thread_current ()->pml4, upage) != NULL)
+			continue;
+		kpage = palloc_get_page (PAL_USER | PAL_ZERO);
+		if (kpage == NULL)
+			return false;
+		if (!install_page (upage, kpage, true)) {
+			palloc_free_page (kpage);
+			return false;
+		}
+	}
+	return true;
+}
+
 /* Adds a mapping from user virtual address UPAGE to kernel
  * virtual address KPAGE to the page table.
  * If WRITABLE is true, the user process may modify the page;
@@ -765,8 +895,7 @@ lazy_load_segment (struct page *page, void *aux) {
 	memset (page->frame->kva + page_read_bytes, 0, page_zero_bytes);
 
 cleanup:
-	// where to remove aux?
-	free (aux);
+	slab_free (&lazy_load_slab, aux);
 	if (error) {
 		palloc_free_page (page->frame->kva);
 	}
@@ -802,7 +931,9 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
 		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		struct lazy_load_args *aux = malloc (sizeof (struct lazy_load_args));
+		struct lazy_load_args *aux = slab_alloc (&lazy_load_slab);
+		if (aux == NULL)
+			return false;
 		*aux = (struct lazy_load_args) {
 		 	.offset = ofs,
 			.read_bytes = page_read_bytes,
@@ -845,4 +976,31 @@ setup_stack (struct intr_frame *if_) {
 	}
 	return success;
 }
+
+/* Reserves the user stack for thread stack slot SLOT, unless an
+ * earlier thread in the slot already did.  Its pages are only
+ * brought in when the thread touches them. */
+static bool
+setup_thread_stack (int slot) {
+	uint8_t *top = (uint8_t *) THREAD_STACK_TOP (slot);
+
+	for (uint8_t *upage = top - PGSIZE; upage > top - THREAD_STACK_SIZE;
+			upage -= PGSIZE) {
+		if (spt_find_page (thread_current ()->spt, upage) != NULL)
+			continue;
+		if (!vm_alloc_page (VM_ANON | VM_MARKER_0, upage, true))
+			return false;
+	}
+	return true;
+}
+
+/* Gives T a new, empty supplemental page table. */
+static bool
+spt_create (struct thread *t) {
+	t->spt = malloc (sizeof *t->spt);
+	if (t->spt == NULL)
+		return false;
+	supplemental_page_table_init (t->spt);
+	return true;
+}
 #endif /* VM */
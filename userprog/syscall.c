@@ -1,5 +1,6 @@
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <string.h>
 #include <syscall-nr.h>
 #include <console.h>
 #include "devices/input.h"
@@ -12,6 +13,7 @@
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "userprog/process.h"
+#include "userprog/futex.h"
 #include "userprog/gdt.h"
 #include "userprog/task.h"
 #include "vm/cr.h"
@@ -38,6 +40,16 @@ static void syscall_close (int fd);
 static int syscall_dup2 (int oldfd, int newfd);
 static void *syscall_mmap (void *addr, size_t length, bool writable, int fd, off_t offset);
 static void syscall_munmap (void *addr);
+static int syscall_futex_wait (const int *uaddr, int expected);
+static int syscall_futex_wake (const int *uaddr, int cnt);
+static tid_t syscall_thread_create (void *entry, void *arg0, void *arg1);
+static int syscall_thread_join (tid_t tid);
+static struct fd *fd_lookup (struct task *, int fd);
+static void close_fd (struct task *, int fd);
+static int dup_fd (struct task *, int oldfd, int newfd);
+static off_t read_to_user (struct file *, uint8_t *buffer, unsigned size);
+static off_t write_from_user (struct file *, const uint8_t *buffer,
+		unsigned size);
 static int64_t get_user (const uint8_t *uaddr);
 static bool put_user (uint8_t *udst, uint8_t byte);
 /* System call.
@@ -64,6 +76,8 @@ syscall_init (void) {
 	 * mode stack. Therefore, we masked the FLAG_FL. */
 	write_msr(MSR_SYSCALL_MASK,
 			FLAG_IF | FLAG_TF | FLAG_DF | FLAG_IOPL | FLAG_AC | FLAG_NT);
+
+	futex_init ();
 }
 
 /* The main system call interface */
@@ -134,9 +148,31 @@ syscall_handler (struct intr_frame *f UNUSED) {
 		case SYS_UMOUNT:
 			PANIC ("Unimplemented syscall syscall_%lld", f->R.rax);
 			break;
+		case SYS_FUTEX_WAIT:
+			f->R.rax = syscall_futex_wait ((const int *) f->R.rdi,
+					(int) f->R.rsi);
+			break;
+		case SYS_FUTEX_WAKE:
+			f->R.rax = syscall_futex_wake ((const int *) f->R.rdi,
+					(int) f->R.rsi);
+			break;
+		case SYS_THREAD_CREATE:
+			f->R.rax = syscall_thread_create ((void *) f->R.rdi,
+					(void *) f->R.rsi, (void *) f->R.rdx);
+			break;
+		case SYS_THREAD_JOIN:
+			f->R.rax = syscall_thread_join ((tid_t) f->R.rdi);
+			break;
+		case SYS_THREAD_EXIT:
+			thread_exit ();
+			break;
 		default:
 			PANIC ("Unknown syscall syscall_%lld", f->R.rax);
 	}
+
+	/* Another thread of the process called exit(). */
+	if (thread_current ()->killed)
+		thread_exit ();
 }
 
 static void
@@ -178,6 +214,16 @@ syscall_exec (const char *cmd_line) {
 		task_exit (-1);
 	}
 
+	/* The other threads run in the address space being replaced.
+	   Only the main thread may exec, after they are gone. */
+	if (task->thread != thread_current ()) {
+		return -1;
+	}
+	task_reap_threads (task, true);
+	if (thread_current ()->killed) {
+		thread_exit ();
+	}
+
 	file_close (task->executable);
 	task->executable = NULL;
 	fn_copy = palloc_get_page (0);
@@ -215,9 +261,7 @@ syscall_create (const char *file, unsigned initial_size) {
 		task_exit (-1);
 	}
 
-	lock_acquire (&process_filesys_lock);
 	bool success = filesys_create (file, initial_size);
-	lock_release (&process_filesys_lock);
 
 	return success;
 }
@@ -237,9 +281,7 @@ syscall_remove (const char *file) {
 		task_exit (-1);
 	}
 
-	lock_acquire (&process_filesys_lock);
 	bool success = filesys_remove (file);
-	lock_release (&process_filesys_lock);
 	return success;
 }
 
@@ -258,15 +300,16 @@ syscall_open (const char *file) {
 		task_exit (-1);
 	}
 
+	lock_acquire (&task->fd_lock);
 	int fd = allocate_fd ();
 	if (fd < 0) {
+		lock_release (&task->fd_lock);
 		return -1;
 	}
 
-	lock_acquire (&process_filesys_lock);
 	struct file *f = filesys_open (file);
-	lock_release (&process_filesys_lock);
 	if (f == NULL) {
+		lock_release (&task->fd_lock);
 		return -1;
 	}
 
@@ -275,46 +318,36 @@ syscall_open (const char *file) {
 	task->fds[fd].fd = fd;
 	task->fds[fd].duplicated = false;
 	task->fds[fd].dup_count = 0;
+	lock_release (&task->fd_lock);
 	return fd;
 }
 
 static int 
 syscall_filesize (int fd) {
 	struct task *task = task_find_by_tid (thread_tid ());
-	struct fd *fd_info = NULL;
+	struct fd *fd_info;
+	int length = -1;
 	if (task == NULL) {
 		return -1;
 	}
 
-	fd = task_find_fd_map (task, fd);
-
-	if (fd < 0 || fd >= MAX_FD) {
-		return -1;
-	}
-
-	fd_info = &task->fds[fd];
-	if (fd_info->closed) {
-		return -1;
-	}
-
-	if (fd_info->file == NULL) {
-		return -1;
+	lock_acquire (&task->fd_lock);
+	fd_info = fd_lookup (task, fd);
+	if (fd_info != NULL && fd_info->file != NULL) {
+		length = file_length (fd_info->file);
 	}
-
-	return file_length (fd_info->file);
+	lock_release (&task->fd_lock);
+	return length;
 }
 
 static int 
 syscall_read (int fd, void *buffer, unsigned size) {
 	struct task *task = task_find_by_tid (thread_tid ());
+	struct fd *fd_info;
+	int result = -1;
 	if (task == NULL) {
 		return -1;
 	}
-	
-	fd = task_find_fd_map (task, fd);
-	if (fd < 0 || fd >= MAX_FD) {
-		return -1;
-	}
 
 	if (!is_user_vaddr (buffer) || !is_user_vaddr (buffer + size)) {
 		task_exit (-1);
@@ -331,8 +364,13 @@ syscall_read (int fd, void *buffer, unsigned size) {
 		task_exit (-1);
 	}
 	wp_disable ();
-	
-	if (task->fds[fd].stdio == 0) {
+
+	lock_acquire (&task->fd_lock);
+	fd_info = fd_lookup (task, fd);
+	if (fd_info != NULL && fd_info->stdio == 0) {
+		/* The keyboard needs no fd-table state; do not hold up
+		   the other threads while waiting for it. */
+		lock_release (&task->fd_lock);
 		for (size_t i = 0; i < size; i++) {
 			bool result = put_user (buffer + i, input_getc());
 			if (!result) {
@@ -343,20 +381,18 @@ syscall_read (int fd, void *buffer, unsigned size) {
 		return size;
 	}
 
-	struct page *page;
-	if (task->fds[fd].closed || task->fds[fd].file == NULL) {
-		return -1;
+	if (fd_info != NULL && fd_info->file != NULL) {
+		result = read_to_user (fd_info->file, buffer, size);
 	}
-	
-	lock_acquire (&process_filesys_lock);
-	off_t ret = file_read (task->fds[fd].file, buffer, size);
-	lock_release (&process_filesys_lock);
-	return ret;
+	lock_release (&task->fd_lock);
+	return result;
 }
 
 static int
 syscall_write (int fd, void *buffer, unsigned size) {
 	struct task *task = task_find_by_tid (thread_tid ());
+	struct fd *fd_info;
+	int result = -1;
 	if (task == NULL) {
 		return -1;
 	}
@@ -369,66 +405,52 @@ syscall_write (int fd, void *buffer, unsigned size) {
 		task_exit (-1);
 	}
 
-	fd = task_find_fd_map (task, fd);
-	if (fd < 0 || fd >= MAX_FD) {
-		return -1;
-	}
-
-	if (task->fds[fd].stdio == 1) {
+	lock_acquire (&task->fd_lock);
+	fd_info = fd_lookup (task, fd);
+	if (fd_info != NULL && fd_info->stdio == 1) {
+		lock_release (&task->fd_lock);
 		putbuf(buffer, size);
 		return size;
 	}
 
-	if (task->fds[fd].closed || task->fds[fd].file == NULL) {
-		return -1;
+	if (fd_info != NULL && fd_info->file != NULL) {
+		result = write_from_user (fd_info->file, buffer, size);
 	}
-
-	lock_acquire (&process_filesys_lock);
-	off_t ret = file_write (task->fds[fd].file, buffer, size);
-	lock_release (&process_filesys_lock);
-	return ret;
+	lock_release (&task->fd_lock);
+	return result;
 }
 
 static void
 syscall_seek (int fd, unsigned pos) {
 	struct task *task = task_find_by_tid (thread_tid ());
+	struct fd *fd_info;
 	if (task == NULL) {
 		return;
 	}
 
-	fd = task_find_fd_map (task, fd);
-
-	if (fd < 0 || fd >= MAX_FD) {
-		return;
-	}
-
-	if (task->fds[fd].closed || task->fds[fd].file == NULL) {
-		return;
+	lock_acquire (&task->fd_lock);
+	fd_info = fd_lookup (task, fd);
+	if (fd_info != NULL && fd_info->file != NULL) {
+		file_seek (fd_info->file, pos);
 	}
-	lock_acquire (&process_filesys_lock);
-	file_seek (task->fds[fd].file, pos);
-	lock_release (&process_filesys_lock);
+	lock_release (&task->fd_lock);
 }
 
 static unsigned
 syscall_tell (int fd) {
 	struct task *task = task_find_by_tid (thread_tid ());
+	struct fd *fd_info;
+	off_t ret = -1;
 	if (task == NULL) {
 		return -1;
 	}
 
-	fd = task_find_fd_map (task, fd);
-
-	if (fd < 0 || fd >= MAX_FD) {
-		return -1;
-	}
-
-	if (task->fds[fd].closed || task->fds[fd].file == NULL) {
-		return -1;
+	lock_acquire (&task->fd_lock);
+	fd_info = fd_lookup (task, fd);
+	if (fd_info != NULL && fd_info->file != NULL) {
+		ret = file_tell (fd_info->file);
 	}
-	lock_acquire (&process_filesys_lock);
-	off_t ret = file_tell (task->fds[fd].file);
-	lock_release (&process_filesys_lock);
+	lock_release (&task->fd_lock);
 	return ret;
 }
 
@@ -439,6 +461,17 @@ syscall_close (int fd) {
 		return;
 	}
 
+	lock_acquire (&task->fd_lock);
+	close_fd (task, fd);
+	lock_release (&task->fd_lock);
+}
+
+/* Closes FD, as seen by the user, in TASK.  TASK's fd_lock must
+   be held. */
+static void
+close_fd (struct task *task, int fd) {
+	ASSERT (lock_held_by_current_thread (&task->fd_lock));
+
 	fd = task_find_fd_map (task, fd);
 
 	if (fd < 0 || fd >= MAX_FD) {
@@ -451,9 +484,7 @@ syscall_close (int fd) {
 
 	/* Neither duplicated nor duplicated by another FD. */
 	if (!task->fds[fd].duplicated && task->fds[fd].dup_count == 0) {
-		lock_acquire (&process_filesys_lock);
 		file_close (task->fds[fd].file);
-		lock_release (&process_filesys_lock);
 		fd_init (&task->fds[fd], fd);
 		return;
 	}
@@ -480,12 +511,26 @@ syscall_close (int fd) {
 static int
 syscall_dup2 (int oldfd, int newfd) {
 	struct task *task = task_find_by_tid (thread_tid ());
-	int newfd_copy = newfd;
+	int result;
 
 	if (task == NULL) {
 		return -1;
 	}
-	
+
+	lock_acquire (&task->fd_lock);
+	result = dup_fd (task, oldfd, newfd);
+	lock_release (&task->fd_lock);
+	return result;
+}
+
+/* Makes NEWFD, as seen by the user, refer to the file of OLDFD in
+   TASK.  TASK's fd_lock must be held. */
+static int
+dup_fd (struct task *task, int oldfd, int newfd) {
+	int newfd_copy = newfd;
+
+	ASSERT (lock_held_by_current_thread (&task->fd_lock));
+
 	oldfd = task_find_fd_map (task, oldfd);
 
 	if (newfd >= MAX_FD) {
@@ -512,7 +557,7 @@ syscall_dup2 (int oldfd, int newfd) {
 	}
 
 	if (!task->fds[newfd].closed) {
-		syscall_close (task->fds[newfd].fd_map);
+		close_fd (task, task->fds[newfd].fd_map);
 	}
 	
 	fd_t parent_fd = task_find_original_fd (task, oldfd);
@@ -533,8 +578,11 @@ syscall_dup2 (int oldfd, int newfd) {
 
 static void *
 syscall_mmap (void *addr, size_t length, bool writable, int fd, off_t offset) {
-	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct supplemental_page_table *spt = thread_current ()->spt;
 	struct task *task = task_find_by_tid (thread_tid ());
+	struct fd *fd_info;
+	struct file *file = NULL;
+	bool stdio = false;
 	struct page *page;
 	if (addr == NULL || !is_user_vaddr (addr)) {
 		return NULL;
@@ -548,32 +596,31 @@ syscall_mmap (void *addr, size_t length, bool writable, int fd, off_t offset) {
 		return NULL;
 	}
 	
-	fd = task_find_fd_map (task, fd);
-	if (task->fds[fd].stdio != -1) {
+	lock_acquire (&task->fd_lock);
+	fd_info = fd_lookup (task, fd);
+	if (fd_info != NULL && fd_info->stdio != -1) {
+		stdio = true;
+	} else if (fd_info != NULL && fd_info->file != NULL
+			&& file_length (fd_info->file) > 0
+			&& file_length (fd_info->file) > offset) {
+		file = file_reopen (fd_info->file);
+	}
+	lock_release (&task->fd_lock);
+
+	if (stdio) {
 		task_exit (-1);
 	}
 
-	if (task->fds[fd].file == NULL) {
-		return NULL;
-	}
-
-	if (file_length (task->fds[fd].file) <= 0) {
+	if (file == NULL) {
 		return NULL;
 	}
 
-	if (file_length (task->fds[fd].file) <= offset) {
-		return NULL;
-	}
-	
-	if (length == 0) {
-		return NULL;
-	}
-
-	if ((page = spt_find_page (spt, addr)) != NULL) {
+	if (length == 0 || (page = spt_find_page (spt, addr)) != NULL) {
+		file_close (file);
 		return NULL;
 	}
 
-	return do_mmap (addr, length, writable, file_reopen (task->fds[fd].file), offset);
+	return do_mmap (addr, length, writable, file, offset);
 }
 
 static void
@@ -584,6 +631,107 @@ syscall_munmap (void *addr) {
 
 	do_munmap (addr);
 }
+
+/* Exits the process unless UADDR is an aligned, mapped user
+   address that can hold a futex word. */
+static void
+check_futex_addr (const int *uaddr) {
+	if (!is_user_vaddr (uaddr) || (uintptr_t) uaddr % sizeof *uaddr != 0
+			|| get_user ((const uint8_t *) uaddr) == -1)
+		task_exit (-1);
+}
+
+static int
+syscall_futex_wait (const int *uaddr, int expected) {
+	check_futex_addr (uaddr);
+	return futex_wait (uaddr, expected);
+}
+
+static int
+syscall_futex_wake (const int *uaddr, int cnt) {
+	check_futex_addr (uaddr);
+	return cnt > 0 ? futex_wake (uaddr, cnt) : 0;
+}
+
+static tid_t
+syscall_thread_create (void *entry, void *arg0, void *arg1) {
+	if (entry == NULL || !is_user_vaddr (entry)) {
+		return TID_ERROR;
+	}
+
+	return process_thread_create (entry, arg0, arg1);
+}
+
+static int
+syscall_thread_join (tid_t tid) {
+	return task_thread_join (thread_current ()->task, tid);
+}
+
+/* Returns the open entry of TASK's fd table that FD, as seen by
+ * the user, names, or a null pointer if there is none.  TASK's
+ * fd_lock must be held. */
+static struct fd *
+fd_lookup (struct task *task, int fd) {
+	ASSERT (lock_held_by_current_thread (&task->fd_lock));
+
+	fd = task_find_fd_map (task, fd);
+	if (fd < 0 || fd >= MAX_FD || task->fds[fd].closed) {
+		return NULL;
+	}
+	return &task->fds[fd];
+}
+
+/* Reads SIZE bytes from FILE into user BUFFER and returns the
+ * number of bytes read.  The data passes through a kernel page,
+ * so that a fault on BUFFER, which may have to read or write
+ * back a file page itself, is never taken while FILE's inode is
+ * locked. */
+static off_t
+read_to_user (struct file *file, uint8_t *buffer, unsigned size) {
+	uint8_t *kbuf = palloc_get_page (0);
+	off_t total = 0;
+
+	if (kbuf == NULL)
+		return -1;
+
+	while (size > 0) {
+		off_t chunk = size < PGSIZE ? size : PGSIZE;
+		off_t n = file_read (file, kbuf, chunk);
+
+		memcpy (buffer + total, kbuf, n);
+		total += n;
+		size -= n;
+		if (n < chunk)
+			break;
+	}
+	palloc_free_page (kbuf);
+	return total;
+}
+
+/* Writes SIZE bytes from user BUFFER to FILE and returns the
+ * number of bytes written.  See read_to_user(). */
+static off_t
+write_from_user (struct file *file, const uint8_t *buffer, unsigned size) {
+	uint8_t *kbuf = palloc_get_page (0);
+	off_t total = 0;
+
+	if (kbuf == NULL)
+		return -1;
+
+	while (size > 0) {
+		off_t chunk = size < PGSIZE ? size : PGSIZE;
+		off_t n;
+
+		memcpy (kbuf, buffer + total, chunk);
+		n = file_write (file, kbuf, chunk);
+		total += n;
+		size -= n;
+		if (n < chunk)
+			break;
+	}
+	palloc_free_page (kbuf);
+	return total;
+}
 /* Reads a byte at user virtual address UADDR.
  * UADDR must be below KERN_BASE.
  * Returns the byte value if successful, -1 if a segfault
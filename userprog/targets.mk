@@ -4,4 +4,6 @@ userprog_SRC += userprog/syscall-entry.S # System call entry.
 userprog_SRC += userprog/syscall.c	# System call handler.
 userprog_SRC += userprog/gdt.c		# GDT initialization.
 userprog_SRC += userprog/tss.c		# TSS management.
-userprog_SRC += userprog/task.c
\ No newline at end of file
+userprog_SRC += userprog/task.c
+userprog_SRC += userprog/fpu.c		# Lazy FPU context switching.
+userprog_SRC += userprog/futex.c	# User-level futex wait queues.
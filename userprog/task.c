@@ -9,6 +9,7 @@
 #include "threads/init.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
+#include "userprog/futex.h"
 #ifdef VM
 #include "vm/vm.h"
 #endif
@@ -16,19 +17,33 @@
 /* List of processes. */
 static struct list process_list;
 
+/* Processes indexed by pid, and those that have a thread by tid. */
+static struct hash tasks_by_pid;
+static struct hash tasks_by_tid;
+
 /* Lock used by allocate_pid(). */
-static struct lock pid_lock;
+static struct mutex pid_lock;
 
-/* Lock for tasks. */
-static struct lock task_lock;
+/* Lock for tasks.  Lookups only read the tables, so they share
+   it; anything that changes a task takes it for writing. */
+static struct rwlock task_lock;
 
 static pid_t allocate_pid (void);
 static void init_process (struct task *task);
+static void task_bind_thread (struct task *task, struct thread *thrd);
+static uint64_t task_id_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool task_id_less (const struct hash_elem *a,
+				const struct hash_elem *b, void *aux UNUSED);
+static struct hash_elem *task_id_find (struct hash *h, int id);
+static void kill_threads (struct task *task);
+static struct task_thread *find_thread (struct task *task, tid_t tid);
 
 void task_init (void) {
 	list_init (&process_list);
-	lock_init (&pid_lock);
-	lock_init (&task_lock);
+	hash_init (&tasks_by_pid, task_id_hash, task_id_less, NULL);
+	hash_init (&tasks_by_tid, task_id_hash, task_id_less, NULL);
+	mutex_init (&pid_lock);
+	rwlock_init (&task_lock);
 }
 
 struct task *
@@ -58,15 +73,16 @@ task_create (const char *file_name, struct thread* thread) {
 
 	strlcpy (fn_copy, file_name, name_len);
 	t->name = fn_copy;
-	t->thread = thread;
 	t->pid = allocate_pid ();
-	lock_acquire (&task_lock);
+	t->pid_entry.id = t->pid;
+	rwlock_write_acquire (&task_lock);
 	list_push_back (&process_list, &t->elem);
-	lock_release (&task_lock);
+	hash_insert (&tasks_by_pid, &t->pid_entry.elem);
 	if (thread != NULL) {
-		t->tid = thread->tid;
+		task_bind_thread (t, thread);
 		t->status = PROCESS_READY;
 	}
+	rwlock_write_release (&task_lock);
 	return t;
 }
 
@@ -80,14 +96,26 @@ task_set_thread (struct task *task, struct thread *thrd) {
 		return false;
 	}
 
-	lock_acquire (&task_lock);
-	task->thread = thrd;
-	task->tid = thrd->tid;
+	rwlock_write_acquire (&task_lock);
+	task_bind_thread (task, thrd);
 	task_set_status (task, PROCESS_READY);
-	lock_release (&task_lock);
+	rwlock_write_release (&task_lock);
 	return true;
 }
 
+/* Makes THRD the thread running TASK.  task_lock must be held
+   for writing. */
+static void
+task_bind_thread (struct task *task, struct thread *thrd) {
+	ASSERT (rwlock_held_by_current_thread (&task_lock));
+
+	task->thread = thrd;
+	task->tid = thrd->tid;
+	task->tid_entry.id = thrd->tid;
+	hash_insert (&tasks_by_tid, &task->tid_entry.elem);
+	thrd->task = task;
+}
+
 bool
 task_set_status (struct task *task, enum process_status status) {
 	ASSERT (status > PROCESS_MIN && status < PROCESS_MAX);
@@ -136,16 +164,24 @@ task_free (struct task *t) {
 	if (t == NULL) {
 		return;
 	}
-	lock_acquire (&task_lock);
+	rwlock_write_acquire (&task_lock);
 	list_remove(&t->elem);
+	hash_delete (&tasks_by_pid, &t->pid_entry.elem);
+	if (t->thread != NULL) {
+		hash_delete (&tasks_by_tid, &t->tid_entry.elem);
+		/* An exited thread's page may already be reused. */
+		if (t->thread == thread_current ())
+			t->thread->task = NULL;
+	}
 	free (t->name);
 	palloc_free_page (t);
-	lock_release (&task_lock);
+	rwlock_write_release (&task_lock);
 }
 
 void 
 task_file_cleanup (struct task *t) {
 	/* Close opened files. */
+	lock_acquire (&t->fd_lock);
 	for (size_t i = 0; i < MAX_FD; i++) {
 		if (!t->fds[i].closed && !t->fds[i].duplicated) {
 			t->fds[i].closed = true;
@@ -153,6 +189,7 @@ task_file_cleanup (struct task *t) {
 			t->fds[i].file = NULL;
 		}
 	}
+	lock_release (&t->fd_lock);
 
 	/* Close the executable file. */
 	file_close (t->executable);
@@ -161,7 +198,9 @@ task_file_cleanup (struct task *t) {
 
 void 
 task_fork_fd (struct task *parent, struct task *child) {
-	lock_acquire (&task_lock);
+	/* The parent's other threads may be using its files. */
+	lock_acquire (&parent->fd_lock);
+	rwlock_write_acquire (&task_lock);
 	for (size_t i = 0; i < MAX_FD; i++) {
 		if (parent->fds[i].file != NULL && !parent->fds[i].duplicated) {
 			child->fds[i].file = file_duplicate (parent->fds[i].file);
@@ -177,60 +216,275 @@ task_fork_fd (struct task *parent, struct task *child) {
 		child->fds[i].fd_map = parent->fds[i].fd_map;
 		child->fds[i].stdio = parent->fds[i].stdio;
 	}
-	lock_release (&task_lock);
+	rwlock_write_release (&task_lock);
+	lock_release (&parent->fd_lock);
 }
 
+/* Ends the current process with STATUS.  Its other threads are
+   killed; the main thread reports STATUS once they are gone. */
 void 
 task_exit (int status) {
 	struct task *task = task_find_by_tid (thread_tid ());
+	bool others;
 	if (task == NULL) {
 		return;
 	}
 
-	task->exit_code = status;
+	lock_acquire (&task->threads_lock);
+	if (!task->exiting) {
+		task->exit_code = status;
+		kill_threads (task);
+	}
+	others = task->thread_cnt > 0;
+	lock_release (&task->threads_lock);
+	if (others) {
+		futex_cancel (task->thread->pml4);
+	}
 	thread_exit ();
 }
 
+/* Marks every thread of TASK but the current one to exit when it
+   next returns to user mode, and keeps new ones from starting.
+   Threads asleep in futex_wait() must still be woken with
+   futex_cancel().  TASK's threads_lock must be held. */
+static void
+kill_threads (struct task *task) {
+	struct thread *curr = thread_current ();
+
+	ASSERT (lock_held_by_current_thread (&task->threads_lock));
+
+	task->exiting = true;
+	if (task->thread != curr)
+		task->thread->killed = true;
+	for (struct list_elem *e = list_begin (&task->threads);
+			e != list_end (&task->threads); e = list_next (e)) {
+		struct task_thread *tt = list_entry (e, struct task_thread, elem);
+		if (tt->thread != NULL && tt->thread != curr)
+			tt->thread->killed = true;
+	}
+}
+
+/* Records a new thread of TASK and reserves a user stack for it.
+   Returns NULL if TASK is exiting, already has TASK_THREAD_MAX
+   threads, or memory is short.  The thread must then either run
+   task_thread_start() or be given to task_thread_discard(). */
+struct task_thread *
+task_thread_add (struct task *task) {
+	struct task_thread *tt = malloc (sizeof *tt);
+	if (tt == NULL) {
+		return NULL;
+	}
+
+	lock_acquire (&task->threads_lock);
+	if (task->exiting || task->stack_slots == UINT32_MAX) {
+		lock_release (&task->threads_lock);
+		free (tt);
+		return NULL;
+	}
+
+	tt->slot = __builtin_ctz (~task->stack_slots);
+	task->stack_slots |= 1u << tt->slot;
+	task->thread_cnt++;
+	tt->tid = TID_ERROR;
+	tt->thread = NULL;
+	tt->task = task;
+	tt->joined = false;
+	sema_init (&tt->started, 0);
+	sema_init (&tt->exited, 0);
+	list_push_back (&task->threads, &tt->elem);
+	lock_release (&task->threads_lock);
+	return tt;
+}
+
+/* Forgets TT, a thread that could not be created. */
+void
+task_thread_discard (struct task_thread *tt) {
+	struct task *task = tt->task;
+
+	lock_acquire (&task->threads_lock);
+	list_remove (&tt->elem);
+	task->stack_slots &= ~(1u << tt->slot);
+	if (--task->thread_cnt == 0 && task->reaping)
+		sema_up (&task->threads_done);
+	lock_release (&task->threads_lock);
+	free (tt);
+}
+
+/* Binds the current thread to TT and lets its creator go on.  A
+   thread that starts while its process is exiting is killed. */
+void
+task_thread_start (struct task_thread *tt) {
+	struct thread *curr = thread_current ();
+	struct task *task = tt->task;
+
+	lock_acquire (&task->threads_lock);
+	tt->tid = curr->tid;
+	tt->thread = curr;
+	curr->task = task;
+	curr->killed = task->exiting;
+	lock_release (&task->threads_lock);
+	sema_up (&tt->started);
+}
+
+/* Called when a thread of TASK other than the main one exits. */
+void
+task_thread_exit (struct task *task) {
+	struct task_thread *tt;
+
+	lock_acquire (&task->threads_lock);
+	tt = find_thread (task, thread_tid ());
+	ASSERT (tt != NULL);
+	tt->thread = NULL;
+	task->stack_slots &= ~(1u << tt->slot);
+	sema_up (&tt->exited);
+	if (--task->thread_cnt == 0 && task->reaping)
+		sema_up (&task->threads_done);
+	lock_release (&task->threads_lock);
+}
+
+/* Waits for thread TID of TASK to exit.  Returns 0 on success, or
+   -1 if TID is not a thread created in TASK or has already been
+   joined. */
+int
+task_thread_join (struct task *task, tid_t tid) {
+	struct task_thread *tt;
+
+	if (tid == TID_ERROR) {
+		return -1;
+	}
+
+	lock_acquire (&task->threads_lock);
+	tt = find_thread (task, tid);
+	if (tt == NULL || tt->joined || tt->thread == thread_current ()) {
+		lock_release (&task->threads_lock);
+		return -1;
+	}
+	tt->joined = true;
+	lock_release (&task->threads_lock);
+
+	sema_down (&tt->exited);
+
+	lock_acquire (&task->threads_lock);
+	list_remove (&tt->elem);
+	lock_release (&task->threads_lock);
+	free (tt);
+	return 0;
+}
+
+/* Waits until every thread of TASK other than the main one has
+   exited, first killing them if KILL is true, and frees their
+   records.  Called by the main thread before it exits or execs,
+   since the address space they run in goes away. */
+void
+task_reap_threads (struct task *task, bool kill) {
+	int running;
+
+	ASSERT (task->thread == thread_current ());
+
+	lock_acquire (&task->threads_lock);
+	if (kill)
+		kill_threads (task);
+	task->reaping = true;
+	running = task->thread_cnt;
+	lock_release (&task->threads_lock);
+
+	if (running > 0) {
+		if (kill)
+			futex_cancel (task->thread->pml4);
+		sema_down (&task->threads_done);
+	}
+
+	/* Joiners are threads of TASK too, so none is left. */
+	lock_acquire (&task->threads_lock);
+	while (!list_empty (&task->threads))
+		free (list_entry (list_pop_front (&task->threads),
+					struct task_thread, elem));
+	task->reaping = false;
+	task->exiting = false;
+	lock_release (&task->threads_lock);
+}
+
+/* Reserves in CHILD, forked by thread FORKER of PARENT, the user
+   stack FORKER runs on, which is the child's main stack. */
+void
+task_fork_stack (struct task *parent, struct task *child,
+		struct thread *forker) {
+	struct task_thread *tt;
+
+	if (forker == parent->thread)
+		return;
+
+	lock_acquire (&parent->threads_lock);
+	tt = find_thread (parent, forker->tid);
+	if (tt != NULL)
+		child->stack_slots = 1u << tt->slot;
+	lock_release (&parent->threads_lock);
+}
+
+/* Returns the thread TID of TASK, or NULL if there is none.
+   TASK's threads_lock must be held. */
+static struct task_thread *
+find_thread (struct task *task, tid_t tid) {
+	for (struct list_elem *e = list_begin (&task->threads);
+			e != list_end (&task->threads); e = list_next (e)) {
+		struct task_thread *tt = list_entry (e, struct task_thread, elem);
+		if (tt->tid == tid)
+			return tt;
+	}
+	return NULL;
+}
+
 struct task *
 task_find_by_pid (pid_t pid) {
-	lock_acquire (&task_lock);
-	struct list_elem *e = NULL;
-	struct task *t = NULL;
-	struct task *found = NULL;
-	for (e = list_begin (&process_list); e != list_end (&process_list); e = list_next (e)) {
-		t = list_entry (e, struct task, elem);
-		if (t->pid == pid) {
-			found = t;
-			break;
-		}
-	}
-	lock_release (&task_lock);
-	return found; 
+	rwlock_read_acquire (&task_lock);
+	struct hash_elem *e = task_id_find (&tasks_by_pid, pid);
+	rwlock_read_release (&task_lock);
+	return e != NULL ? hash_entry (e, struct task, pid_entry.elem) : NULL;
 }
 
+/* Returns the process run by thread TID.  The running thread
+   finds its own process without a lookup. */
 struct task *
 task_find_by_tid (tid_t tid) {
-	lock_acquire (&task_lock);
-	struct list_elem *e = NULL;
-	struct task *t = NULL;
-	struct task *found = NULL;
-	for (e = list_begin (&process_list); e != list_end (&process_list); e = list_next (e)) {
-		t = list_entry(e, struct task, elem);
-		if (t->thread != NULL && t->tid == tid) {
-			found = t;
-			break;
-		}
-	}
-	lock_release (&task_lock);
+	struct thread *curr = thread_current ();
+	if (curr->tid == tid)
+		return curr->task;
+
+	rwlock_read_acquire (&task_lock);
+	struct hash_elem *e = task_id_find (&tasks_by_tid, tid);
+	rwlock_read_release (&task_lock);
+	return e != NULL ? hash_entry (e, struct task, tid_entry.elem) : NULL;
+}
+
+/* Returns the element of H with ID, or a null pointer if there
+   is none. */
+static struct hash_elem *
+task_id_find (struct hash *h, int id) {
+	struct task_id key;
+
+	key.id = id;
+	return hash_find (h, &key.elem);
+}
+
+/* Returns a hash value for the id of task table entry E. */
+static uint64_t
+task_id_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_int (hash_entry (e, struct task_id, elem)->id);
+}
 
-	return found;
+/* Returns true if task table entry A has a smaller id than B. */
+static bool
+task_id_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct task_id, elem)->id
+		< hash_entry (b, struct task_id, elem)->id;
 }
 
 size_t
 task_child_len (struct task *t) {
-	lock_acquire (&task_lock);
+	rwlock_read_acquire (&task_lock);
 	size_t size = list_size (&t->children);
-	lock_release (&task_lock);
+	rwlock_read_release (&task_lock);
 	return size;
 }
 
@@ -239,9 +493,9 @@ allocate_pid (void) {
 	static pid_t next_pid = 1;
 	pid_t pid;
 
-	lock_acquire (&pid_lock);
+	mutex_lock (&pid_lock);
 	pid = next_pid++;
-	lock_release (&pid_lock);
+	mutex_unlock (&pid_lock);
 
 	return pid;
 }
@@ -260,6 +514,14 @@ init_process (struct task *task) {
 	sema_init (&task->fork_lock, 0);
 	sema_init (&task->wait_lock, 0);
 	list_init (&task->children);
+	lock_init (&task->fd_lock);
+	lock_init (&task->threads_lock);
+	list_init (&task->threads);
+	task->thread_cnt = 0;
+	task->stack_slots = 0;
+	task->exiting = false;
+	task->reaping = false;
+	sema_init (&task->threads_done, 0);
 
 	for (size_t i = 0; i < 3; i++) {
 		fd_init (&task->fds[i], i);
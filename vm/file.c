@@ -4,7 +4,7 @@
 #include "userprog/process.h"
 #include "threads/vaddr.h"
 #include "threads/mmu.h"
-#include "threads/malloc.h"
+#include "threads/slab.h"
 #include "threads/synch.h"
 
 static bool file_backed_swap_in (struct page *page, void *kva);
@@ -105,7 +105,7 @@ lazy_load_mmap (struct page *page, void *aux) {
 	memset (page->frame->kva + page_read_bytes, 0, page_zero_bytes);
 
 cleanup:
-	free (aux);
+	slab_free (&lazy_load_slab, aux);
 	if (error) {
 		palloc_free_page (page->frame->kva);
 		frame_return (page->frame);
@@ -131,7 +131,9 @@ do_mmap (void *addr, size_t length, int writable,
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
 		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		struct lazy_load_args *aux = malloc (sizeof (struct lazy_load_args));
+		struct lazy_load_args *aux = slab_alloc (&lazy_load_slab);
+		if (aux == NULL)
+			return NULL;
 		*aux = (struct lazy_load_args) {
 			.file = file,
 		 	.offset = offset,
@@ -160,7 +162,7 @@ do_mmap (void *addr, size_t length, int writable,
 void 
 do_munmap (void *addr) {
 	while (true) {
-		struct page* page = spt_find_page (&thread_current ()->spt, addr);
+		struct page* page = spt_find_page (thread_current ()->spt, addr);
 		if (page == NULL) {
 			break;
 		}
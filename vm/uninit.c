@@ -10,7 +10,7 @@
 
 #include "vm/vm.h"
 #include "vm/uninit.h"
-#include "threads/malloc.h"
+#include "threads/slab.h"
 
 static bool uninit_initialize (struct page *page, void *kva);
 static void uninit_destroy (struct page *page);
@@ -73,6 +73,6 @@ uninit_destroy (struct page *page) {
 	/* TODO: Fill this function.
 	 * TODO: If you don't have anything to do, just return. */	
 	if (page->uninit.aux != NULL) {
-		free (page->uninit.aux);	
+		slab_free (&lazy_load_slab, page->uninit.aux);	
 	}
 }
\ No newline at end of file
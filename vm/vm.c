@@ -5,11 +5,11 @@
 #include <string.h>
 #include "threads/malloc.h"
 #include "threads/mmu.h"
+#include "threads/slab.h"
 #include "userprog/process.h"
 #include "vm/inspect.h"
 #include "filesys/page_cache.h"
 
-#define FRAME_POOL_SIZE 100
 static struct page *page_lookup (struct supplemental_page_table *spt, void *addr);
 static bool page_less (const struct hash_elem *a_,
 					const struct hash_elem *b_, void *aux UNUSED);
@@ -22,10 +22,13 @@ static bool page_copy_file (struct supplemental_page_table *dst,
 static bool page_copy_uninit (struct supplemental_page_table *dst, 
 				struct supplemental_page_table *src, struct page* page);
 static inline bool is_within_stack_boundary (uintptr_t addr, uintptr_t rsp);
-static void frame_pool_init (size_t size);
-static struct list frame_pool;
-static struct lock frame_lock;
-static size_t frame_pool_size;
+static bool spt_lock (struct supplemental_page_table *spt);
+static void spt_unlock (struct supplemental_page_table *spt, bool locked);
+static struct mutex frame_lock;
+
+/* Object caches. */
+static struct slab_cache frame_slab;    /* struct frame. */
+struct slab_cache lazy_load_slab;       /* struct lazy_load_args. */
 
 /* List of frames in use */
 static struct list frame_list;
@@ -42,7 +45,10 @@ vm_init (void) {
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
 	/* TODO: Your code goes here. */
-	frame_pool_init (FRAME_POOL_SIZE);
+	slab_cache_init (&frame_slab, "frame", sizeof (struct frame));
+	slab_cache_init (&lazy_load_slab, "lazy_load_args",
+			sizeof (struct lazy_load_args));
+	mutex_init (&frame_lock);
 	list_init (&frame_list);
 }
 
@@ -74,7 +80,8 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 	ASSERT (VM_TYPE(type) != VM_UNINIT)
 
-	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct supplemental_page_table *spt = thread_current ()->spt;
+	bool locked = spt_lock (spt);
 
 	/* Check wheter the upage is already occupied or not. */
 	if (spt_find_page (spt, upage) == NULL) {
@@ -104,17 +111,19 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 		}	
 		uninit_new (page, upage, init, type, aux, initializer);
 		page->writable = writable;
-		page->tid = thread_tid ();
+		page->tid = spt->tid;
 		/* TODO: Insert the page into the spt. */
 		if (!spt_insert_page (spt, page)) {
 			free (page);
-			free (aux);
+			slab_free (&lazy_load_slab, aux);
 			goto err;
 		}
 
+		spt_unlock (spt, locked);
 		return true;
 	}
 err:
+	spt_unlock (spt, locked);
 	return false;
 }
 
@@ -122,10 +131,10 @@ err:
 struct page *
 spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
 	struct page *page;
+	bool locked = spt_lock (spt);
 	/* TODO: Fill this function. */
-	if ((page = page_lookup (spt, va)) == NULL) {
-		return NULL;
-	}
+	page = page_lookup (spt, va);
+	spt_unlock (spt, locked);
 	return page;
 }
 
@@ -133,7 +142,10 @@ spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
 bool
 spt_insert_page (struct supplemental_page_table *spt UNUSED,
 		struct page *page UNUSED) {
-	return hash_insert (&spt->page_map, &page->elem) == NULL;
+	bool locked = spt_lock (spt);
+	bool success = hash_insert (&spt->page_map, &page->elem) == NULL;
+	spt_unlock (spt, locked);
+	return success;
 }
 
 void
@@ -146,9 +158,9 @@ static struct frame *
 vm_get_victim (void) {
 	struct frame *victim = NULL;
 	bool found = false;
-	lock_acquire (&frame_lock);
+	mutex_lock (&frame_lock);
 	victim = list_entry (list_pop_front (&frame_list), struct frame, felem);
-	lock_release (&frame_lock);
+	mutex_unlock (&frame_lock);
 	return victim;
 }
 
@@ -225,11 +237,12 @@ vm_handle_wp (struct page *page UNUSED) {
 bool
 vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
 		bool user UNUSED, bool write UNUSED, bool not_present UNUSED) {
-	struct supplemental_page_table *spt UNUSED = &thread_current ()->spt;
+	struct supplemental_page_table *spt UNUSED = thread_current ()->spt;
 	struct page *page = NULL;
+	bool success = false;
 	/* TODO: Validate the fault */
 	/* TODO: Your code goes here */
-	if (addr == NULL) {
+	if (addr == NULL || spt == NULL) {
 		return false;
 	}
 
@@ -243,22 +256,27 @@ vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
 		return false;
 	}
 
-	/* If the page is exist, claim it. */
+	/* Another thread of the process may fault on the same page at
+	   the same time, so the whole fault is handled under the lock.
+	   If it got there first, the page is already in. */
+	lock_acquire (&spt->lock);
 	if ((page = spt_find_page (spt, addr)) != NULL) {
-		return vm_do_claim_page (page);
-	}
-
-	/* Try stack growth */
-	uintptr_t rsp = f->rsp;
-	if (!user) {
-		rsp = thread_current ()->intr_rsp;
-	}
+		/* If the page is exist, claim it. */
+		success = pml4_get_page (thread_current ()->pml4, page->va) != NULL
+			|| vm_do_claim_page (page);
+	} else {
+		/* Try stack growth */
+		uintptr_t rsp = f->rsp;
+		if (!user) {
+			rsp = thread_current ()->intr_rsp;
+		}
 
-	if (is_within_stack_boundary ((uintptr_t) addr, rsp)) {
-		return vm_stack_growth (addr);
+		if (is_within_stack_boundary ((uintptr_t) addr, rsp)) {
+			success = vm_stack_growth (addr);
+		}
 	}
-
-	return false;
+	lock_release (&spt->lock);
+	return success;
 }
 
 /* Free the page.
@@ -272,13 +290,14 @@ vm_dealloc_page (struct page *page) {
 /* Claim the page that allocate on VA. */
 bool
 vm_claim_page (void *va UNUSED) {
-	struct page *page = spt_find_page (&thread_current ()->spt, va);
+	struct supplemental_page_table *spt = thread_current ()->spt;
+	bool locked = spt_lock (spt);
+	struct page *page = spt_find_page (spt, va);
+	bool success;
 	/* TODO: Fill this function */
-	if (page == NULL) {
-		return false;
-	}
-
-	return vm_do_claim_page (page);
+	success = page != NULL && vm_do_claim_page (page);
+	spt_unlock (spt, locked);
+	return success;
 }
 
 /* Claim the PAGE and set up the mmu. */
@@ -313,9 +332,9 @@ end:
 		return success;
 	}
 
-	lock_acquire (&frame_lock);
+	mutex_lock (&frame_lock);
 	list_push_back (&frame_list, &frame->felem);
-	lock_release (&frame_lock);
+	mutex_unlock (&frame_lock);
 	return success;
 }
 
@@ -323,6 +342,8 @@ end:
 void
 supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
 	hash_init (&spt->page_map, page_hash, page_less, NULL);
+	lock_init (&spt->lock);
+	spt->tid = thread_tid ();
 }
 
 /* Copy supplemental page table from src to dst */
@@ -330,9 +351,12 @@ bool
 supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
 		struct supplemental_page_table *src UNUSED) {
 	struct hash_iterator iter;
+	bool success = false;
+
+	/* Other threads of the parent keep running during the copy. */
+	lock_acquire (&src->lock);
 	hash_clear (&dst->page_map, page_map_destruct);
 	hash_first (&iter, &src->page_map);
-	bool success = false;
 	while (hash_next (&iter)) {
 		struct page *page = hash_entry (hash_cur (&iter), struct page, elem);
 		enum vm_type type = VM_TYPE (page->operations->type);
@@ -368,6 +392,7 @@ fail:
 	if (!success) {
 		hash_clear (&dst->page_map, page_map_destruct);
 	}
+	lock_release (&src->lock);
 	return success;
 }
 
@@ -375,7 +400,7 @@ fail:
 void
 supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
 	/* TODO: Destroy all the supplemental_page_table hold by thread */
-	hash_clear (&thread_current ()->spt.page_map, page_map_destruct);
+	hash_clear (&spt->page_map, page_map_destruct);
 	/* TODO: writeback all the modified contents to the storage. */
 }
 
@@ -452,7 +477,7 @@ page_copy_uninit (struct supplemental_page_table *dst UNUSED,
 	void *va = page->va;
 
 	if ((page->uninit.type & VM_MARKER_1)) {
-		void *aux = malloc (sizeof (struct lazy_load_args));
+		void *aux = slab_alloc (&lazy_load_slab);
 		if (aux == NULL) {
 			return false;
 		}
@@ -462,46 +487,39 @@ page_copy_uninit (struct supplemental_page_table *dst UNUSED,
 	return false;
 }
 
+/* Locks SPT, unless the current thread already holds it while
+   handling a fault.  Returns true if SPT was locked here, to be
+   passed to spt_unlock(). */
+static bool
+spt_lock (struct supplemental_page_table *spt) {
+	if (lock_held_by_current_thread (&spt->lock))
+		return false;
+	lock_acquire (&spt->lock);
+	return true;
+}
+
+/* Undoes spt_lock(), which returned LOCKED. */
+static void
+spt_unlock (struct supplemental_page_table *spt, bool locked) {
+	if (locked)
+		lock_release (&spt->lock);
+}
+
 static inline bool
 is_within_stack_boundary (uintptr_t addr, uintptr_t rsp) {
 	static const uintptr_t boundary = USER_STACK - MAX_STACK_SIZE;
 	return	boundary <= addr && USER_STACK >= addr && rsp - 8 <= addr;
 }
 
-static void
-frame_pool_init (size_t size) {
-	lock_init (&frame_lock);
-	list_init (&frame_pool);
-	for (size_t i = 0; i < size; i++) {
-		struct frame *frame = calloc (1, sizeof (struct frame));
-		if (frame == NULL) {
-			PANIC ("Failed to initalize frame pool.");
-		}
-		list_push_back (&frame_pool, &frame->elem);
-		frame_pool_size += 1;
-	}
-}
-
 struct frame *
 frame_get (void) {
-	struct frame *frame = NULL;
-	lock_acquire (&frame_lock);
-	if (frame_pool_size > 0) {
-		frame = list_entry (list_pop_front (&frame_pool), struct frame, elem);
-		frame_pool_size -= 1;
+	struct frame *frame = slab_alloc (&frame_slab);
+	if (frame != NULL)
 		memset (frame, 0x00, sizeof (struct frame));
-	} else {
-		frame = calloc (1, sizeof (struct frame));
-	}
-	lock_release (&frame_lock);
 	return frame;
 }
 
 void
 frame_return (struct frame *frame) {
-	lock_acquire (&frame_lock);
-	frame_pool_size += 1;
-	frame->page = NULL;
-	list_push_back (&frame_pool, &frame->elem);
-	lock_release (&frame_lock);
+	slab_free (&frame_slab, frame);
 }
\ No newline at end of file